@@ -0,0 +1,167 @@
+#ifndef GRAVITY_SNAPSHOT_ADAPTIVE_H
+#define GRAVITY_SNAPSHOT_ADAPTIVE_H
+
+#include "field-grid.h"
+#include <cmath>
+
+// The masses' pull at (x, y) through whichever evaluator is active: the
+// field grid, the quadtree or the direct sum. N > 0 is only used when
+// neither the grid nor the tree is.
+template<int N>
+inline void pull(float x, float y, float &xa, float &ya, const float *mx, const float *my,
+		 const Sim_Params &sp) {
+  if (N > 0) {
+    accelerate<N>(x, y, xa, ya, mx, my, sp);
+  } else if (!sp.field || !sp.field->sample(x, y, xa, ya)) {
+    accelerate_direct(x, y, xa, ya, sp);
+  }
+}
+
+// Dormand-Prince 5(4) with an adaptive step size per particle
+// (-integrator dopri). A call advances every particle by steps * dt of
+// simulated time in as many steps of its own size as it takes to keep the
+// estimated error of each step below sp.tolerance pixels (or pixels per
+// unit of time for the velocity). Particles far from the masses take a few
+// large steps, close encounters many small ones. The step size a particle
+// ended on is kept in the span for the next call.
+//
+// The state is (position, velocity), whose derivative is (velocity, pull).
+// On return xa and ya hold the pull at the new position, as they do for
+// the fixed step kernels.
+namespace dopri {
+
+const float C[7] = {0, 1 / 5.f, 3 / 10.f, 4 / 5.f, 8 / 9.f, 1, 1};
+const float A[7][6] = {
+  {0, 0, 0, 0, 0, 0},
+  {1 / 5.f, 0, 0, 0, 0, 0},
+  {3 / 40.f, 9 / 40.f, 0, 0, 0, 0},
+  {44 / 45.f, -56 / 15.f, 32 / 9.f, 0, 0, 0},
+  {19372 / 6561.f, -25360 / 2187.f, 64448 / 6561.f, -212 / 729.f, 0, 0},
+  {9017 / 3168.f, -355 / 33.f, 46732 / 5247.f, 49 / 176.f, -5103 / 18656.f, 0},
+  {35 / 384.f, 0, 500 / 1113.f, 125 / 192.f, -2187 / 6784.f, 11 / 84.f},
+};
+// Difference between the 5th and the embedded 4th order weights
+const float E[7] = {71 / 57600.f, 0, -71 / 16695.f, 71 / 1920.f, -17253 / 339200.f, 22 / 525.f,
+		    -1 / 40.f};
+
+// Bounds on how much the step size may change after one step
+const float SAFETY = .9f;
+const float MIN_FACTOR = .2f;
+const float MAX_FACTOR = 5;
+// Steps are never made shorter than this fraction of dt, so a particle
+// that cannot meet the tolerance still makes progress
+const float MIN_STEP = 1e-4f;
+
+}
+
+template<int N>
+inline void integrate_dopri(float &x, float &y, float &xv, float &yv, float &xa, float &ya,
+			    float &h, float duration, const float *mx, const float *my,
+			    const Sim_Params &sp) {
+  using namespace dopri;
+  // k[s] = derivative at stage s: velocity (kx, ky) and pull (kvx, kvy)
+  float kx[7], ky[7], kvx[7], kvy[7];
+  kx[0] = xv;
+  ky[0] = yv;
+  pull<N>(x, y, kvx[0], kvy[0], mx, my, sp);
+
+  const float min_step = MIN_STEP * sp.dt;
+  if (!(h > 0)) {
+    h = sp.dt;
+  }
+  float t = 0;
+  while (t < duration) {
+    const float left = duration - t;
+    const bool last = h >= left;
+    const float step = last ? left : h;
+
+    float sx = 0, sy = 0, svx = 0, svy = 0;
+    for (int s = 1; s < 7; ++s) {
+      sx = x;
+      sy = y;
+      svx = xv;
+      svy = yv;
+      for (int j = 0; j < s; ++j) {
+	const float a = step * A[s][j];
+	sx += a * kx[j];
+	sy += a * ky[j];
+	svx += a * kvx[j];
+	svy += a * kvy[j];
+      }
+      kx[s] = svx;
+      ky[s] = svy;
+      pull<N>(sx, sy, kvx[s], kvy[s], mx, my, sp);
+    }
+    // The last stage is the 5th order solution itself
+    float ex = 0, ey = 0, evx = 0, evy = 0;
+    for (int s = 0; s < 7; ++s) {
+      ex += E[s] * kx[s];
+      ey += E[s] * ky[s];
+      evx += E[s] * kvx[s];
+      evy += E[s] * kvy[s];
+    }
+    float err = step * std::max(std::max(fabsf(ex), fabsf(ey)), std::max(fabsf(evx), fabsf(evy)))
+      / sp.tolerance;
+
+    float factor = err > 0 ? SAFETY * powf(err, -.2f) : MAX_FACTOR;
+    factor = std::min(MAX_FACTOR, std::max(MIN_FACTOR, factor));
+    // NaN errors fail this as well
+    const bool accept = err <= 1 || step <= min_step;
+    if (accept) {
+      x = sx;
+      y = sy;
+      xv = svx;
+      yv = svy;
+      kx[0] = kx[6];
+      ky[0] = ky[6];
+      kvx[0] = kvx[6];
+      kvy[0] = kvy[6];
+      t = last ? duration : t + step;
+    }
+    // A step cut short to end on the frame says nothing about the step size
+    // to continue with, unless it failed
+    if (!accept || !last || step * factor < h) {
+      h = std::max(min_step, step * factor);
+    }
+  }
+  xa = kvx[0];
+  ya = kvy[0];
+}
+
+template<int N>
+void integrate_span_dopri(const Span &s, int steps, const Sim_Params &sp) {
+  float mx[N > 0 ? N : 1], my[N > 0 ? N : 1];
+  for (int m = 0; m < N; ++m) {
+    mx[m] = sp.mx[m];
+    my[m] = sp.my[m];
+  }
+  const float duration = steps * sp.dt;
+  for (int i = 0; i < s.n; ++i) {
+    float x = s.x[i], y = s.y[i];
+    float xv = s.xv[i], yv = s.yv[i];
+    float xa = s.xa[i], ya = s.ya[i];
+    float h = s.h ? s.h[i] : 0;
+    integrate_dopri<N>(x, y, xv, yv, xa, ya, h, duration, mx, my, sp);
+    s.x[i] = x;
+    s.y[i] = y;
+    s.xv[i] = xv;
+    s.yv[i] = yv;
+    s.xa[i] = xa;
+    s.ya[i] = ya;
+    if (s.h) {
+      s.h[i] = h;
+    }
+  }
+}
+
+// The adaptive kernel for the active force evaluator. The steps of each
+// particle depend on its own error, so there is one scalar kernel for
+// every -simd level.
+inline Span_Kernel dopri_span_kernel(const Sim_Params &sp) {
+  if (sp.field || sp.tree) {
+    return integrate_span_dopri<0>;
+  }
+  GS_MASS_DISPATCH(integrate_span_dopri, sp.nmasses)
+}
+
+#endif
@@ -0,0 +1,290 @@
+#ifndef GRAVITY_SNAPSHOT_CHECKPOINT_H
+#define GRAVITY_SNAPSHOT_CHECKPOINT_H
+
+#include "particles.h"
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+// Checkpoints (-checkpoint, -resume): everything a run needs to carry on
+// exactly where it stopped. Its command line, the masses (which may be
+// random), how far it got and every array of its Particles, bit for bit.
+//
+// The file, in the byte order of the machine that wrote it:
+//   "GSCHECKP"           magic
+//   u32                  CHECKPOINT_VERSION
+//   i32, i32, u64        width, height and row stride of the particles
+//   i64, i64             next frame to render, steps integrated so far
+//   i32                  digits of the frame numbers in file names
+//   u32, bytes           save directory: length, then bytes
+//   u32, then per arg    command line: count, then length and bytes
+//   u32, f32[n], f32[n]  masses: count, x, y
+//   u32, then per array  Particles::arrays(): count, then a 16 byte name,
+//                        u64 size and the contents
+//
+// Readers reject other versions. Bump it whenever the layout or the meaning
+// of an array changes.
+const uint32_t CHECKPOINT_VERSION = 3;
+const char CHECKPOINT_MAGIC[8] = {'G', 'S', 'C', 'H', 'E', 'C', 'K', 'P'};
+const size_t CHECKPOINT_NAME = 16;
+
+struct Checkpoint {
+  int32_t width = 0;
+  int32_t height = 0;
+  uint64_t stride = 0;
+  int64_t frame = 0;
+  int64_t steps_done = 0;
+  // How the frames are named, kept for the rest of the run: a different
+  // -frames must not change the width of the numbers, and a stored -g must
+  // not make a new directory
+  int32_t digits = 0;
+  std::string directory;
+  std::vector<std::string> args;
+  std::vector<float> mx, my;
+
+  // Reads everything but the arrays, which load_particles() reads into
+  // Particles of the same size. Returns false with error set otherwise.
+  bool read(const std::string &file, std::string &error) {
+    path = file;
+    FILE *f = fopen(path.c_str(), "rb");
+    if (!f) {
+      error = "could not open `" + path + "`";
+      return false;
+    }
+    bool ok = read_header(f, error);
+    arrays_at = ok ? ftell(f) : 0;
+    fclose(f);
+    return ok;
+  }
+
+  bool load_particles(Particles &p, std::string &error) const {
+    if (p.width != width || p.height != height || p.stride != stride) {
+      error = "it is of a different size";
+      return false;
+    }
+    FILE *f = fopen(path.c_str(), "rb");
+    if (!f || fseek(f, arrays_at, SEEK_SET) != 0) {
+      error = "could not read `" + path + "`";
+      if (f) {
+	fclose(f);
+      }
+      return false;
+    }
+    std::vector<Particles::Array> arrays = p.arrays();
+    uint32_t n = 0;
+    bool ok = get(f, n) && n == arrays.size();
+    for (uint32_t i = 0; ok && i < n; ++i) {
+      char name[CHECKPOINT_NAME];
+      uint64_t bytes = 0;
+      ok = fread(name, sizeof(name), 1, f) == 1 && get(f, bytes);
+      name[CHECKPOINT_NAME - 1] = 0;
+      const Particles::Array *a = nullptr;
+      for (const Particles::Array &b : arrays) {
+	if (strcmp(b.name, name) == 0 && b.bytes == bytes) {
+	  a = &b;
+	}
+      }
+      ok = ok && a && fread(a->data, 1, a->bytes, f) == a->bytes;
+    }
+    fclose(f);
+    if (!ok) {
+      error = "its state does not match the options, or it is truncated";
+    }
+    return ok;
+  }
+
+private:
+  std::string path;
+  long arrays_at = 0;
+
+  template<typename T>
+  static bool get(FILE *f, T &v) {
+    return fread(&v, sizeof(v), 1, f) == 1;
+  }
+
+  bool read_header(FILE *f, std::string &error) {
+    char magic[sizeof(CHECKPOINT_MAGIC)];
+    uint32_t version = 0;
+    if (fread(magic, sizeof(magic), 1, f) != 1 ||
+	memcmp(magic, CHECKPOINT_MAGIC, sizeof(magic)) != 0 || !get(f, version)) {
+      error = "`" + path + "` is not a checkpoint";
+      return false;
+    }
+    if (version != CHECKPOINT_VERSION) {
+      error = "`" + path + "` is a version " + std::to_string(version) +
+	" checkpoint, this program reads version " + std::to_string(CHECKPOINT_VERSION);
+      return false;
+    }
+    uint32_t ndir = 0, nargs = 0, nmasses = 0;
+    bool ok = get(f, width) && get(f, height) && get(f, stride) && get(f, frame) &&
+      get(f, steps_done) && get(f, digits) && get(f, ndir) && ndir < 4096;
+    if (ok) {
+      directory.resize(ndir);
+      ok = fread(&directory[0], 1, ndir, f) == ndir;
+    }
+    ok = ok && get(f, nargs);
+    for (uint32_t i = 0; ok && i < nargs; ++i) {
+      uint32_t len = 0;
+      ok = get(f, len) && len < 4096;
+      std::string arg(len, '\0');
+      ok = ok && fread(&arg[0], 1, len, f) == len;
+      args.push_back(arg);
+    }
+    ok = ok && get(f, nmasses) && nmasses < (1u << 24);
+    if (ok) {
+      mx.resize(nmasses);
+      my.resize(nmasses);
+      ok = fread(mx.data(), sizeof(float), nmasses, f) == nmasses &&
+	fread(my.data(), sizeof(float), nmasses, f) == nmasses;
+    }
+    if (!ok) {
+      error = "`" + path + "` is truncated";
+    }
+    return ok;
+  }
+};
+
+// Writes checkpoints to path through a temporary file that is then renamed
+// over it, so path always holds a complete one. A background save forks:
+// the child process gets a copy-on-write snapshot of the particles to write
+// out while the renderer carries on. That does not work for out of core
+// particles, whose shared mapping the renderer keeps changing under the
+// child, so those are saved in the foreground.
+class Checkpoint_Writer {
+public:
+  explicit Checkpoint_Writer(const std::string &file) : path(file), temp(file + ".tmp") {}
+
+  ~Checkpoint_Writer() {
+    wait();
+  }
+
+  Checkpoint_Writer(const Checkpoint_Writer &) = delete;
+  Checkpoint_Writer &operator=(const Checkpoint_Writer &) = delete;
+
+  // Starts saving c and p. Waits for the previous background save first.
+  // Returns false if this or the previous save failed.
+  bool save(const Checkpoint &c, const Particles &p, bool background) {
+    bool ok = wait();
+    std::vector<unsigned char> head = serialize(c, p);
+    std::vector<Particles::Array> arrays = p.arrays();
+    if (background && !p.file) {
+      // Only write() and friends from here on in the child: other threads
+      // may have held the heap's lock at the fork
+      pid_t pid = fork();
+      if (pid == 0) {
+	_exit(write_file(head, arrays) ? 0 : 1);
+      } else if (pid > 0) {
+	child = pid;
+	return ok;
+      }
+      // Out of memory for the fork, save in the foreground instead
+    }
+    if (!write_file(head, arrays)) {
+      printf("Error: could not write the checkpoint `%s`\n", path.c_str());
+      return false;
+    }
+    return ok;
+  }
+
+  // Waits for the background save. Returns false if it failed.
+  bool wait() {
+    if (child <= 0) {
+      return true;
+    }
+    int status = 0;
+    while (waitpid(child, &status, 0) < 0 && errno == EINTR) {
+    }
+    child = -1;
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+      printf("Error: could not write the checkpoint `%s`\n", path.c_str());
+      return false;
+    }
+    return true;
+  }
+
+private:
+  std::string path;
+  std::string temp;
+  pid_t child = -1;
+
+  template<typename T>
+  static void put(std::vector<unsigned char> &b, const T &v) {
+    const unsigned char *c = (const unsigned char *)&v;
+    b.insert(b.end(), c, c + sizeof(v));
+  }
+
+  // Everything up to the arrays
+  static std::vector<unsigned char> serialize(const Checkpoint &c, const Particles &p) {
+    std::vector<unsigned char> b(CHECKPOINT_MAGIC, CHECKPOINT_MAGIC + sizeof(CHECKPOINT_MAGIC));
+    put(b, CHECKPOINT_VERSION);
+    put(b, (int32_t)p.width);
+    put(b, (int32_t)p.height);
+    put(b, (uint64_t)p.stride);
+    put(b, c.frame);
+    put(b, c.steps_done);
+    put(b, c.digits);
+    put(b, (uint32_t)c.directory.size());
+    b.insert(b.end(), c.directory.begin(), c.directory.end());
+    put(b, (uint32_t)c.args.size());
+    for (const std::string &a : c.args) {
+      put(b, (uint32_t)a.size());
+      b.insert(b.end(), a.begin(), a.end());
+    }
+    put(b, (uint32_t)c.mx.size());
+    for (float x : c.mx) {
+      put(b, x);
+    }
+    for (float y : c.my) {
+      put(b, y);
+    }
+    return b;
+  }
+
+  static bool write_all(int fd, const void *data, size_t bytes) {
+    const char *d = (const char *)data;
+    while (bytes > 0) {
+      ssize_t n = write(fd, d, bytes);
+      if (n < 0 && errno == EINTR) {
+	continue;
+      } else if (n <= 0) {
+	return false;
+      }
+      d += n;
+      bytes -= n;
+    }
+    return true;
+  }
+
+  bool write_file(const std::vector<unsigned char> &head,
+		  const std::vector<Particles::Array> &arrays) const {
+    int fd = open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+      return false;
+    }
+    bool ok = write_all(fd, head.data(), head.size());
+    uint32_t n = arrays.size();
+    ok = ok && write_all(fd, &n, sizeof(n));
+    for (const Particles::Array &a : arrays) {
+      char name[CHECKPOINT_NAME] = {};
+      strncpy(name, a.name, CHECKPOINT_NAME - 1);
+      uint64_t bytes = a.bytes;
+      ok = ok && write_all(fd, name, sizeof(name)) && write_all(fd, &bytes, sizeof(bytes)) &&
+	write_all(fd, a.data, a.bytes);
+    }
+    ok = ok && fsync(fd) == 0;
+    ok = close(fd) == 0 && ok;
+    ok = ok && rename(temp.c_str(), path.c_str()) == 0;
+    if (!ok) {
+      unlink(temp.c_str());
+    }
+    return ok;
+  }
+};
+
+#endif
@@ -0,0 +1,172 @@
+#ifndef GRAVITY_SNAPSHOT_COLOR_H
+#define GRAVITY_SNAPSHOT_COLOR_H
+
+#include "integrate.h"
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+// Coloring of the pixels from where their points end up. Mass i stands for
+// channel i % 3: the channel of the nearest mass is 255, the others fall
+// off with their mass's distance compared to the sum of the distances.
+//
+// The kernels color a span of points into planar memory, red, green and
+// blue `plane` bytes apart as in a CImg, and all of them produce the same
+// bytes.
+
+// hypotf() as glibc computes it: the squares are exact in double, whose
+// sum and root are rounded to float at the end. Written out so the vector
+// kernels can do the same.
+inline float color_distance(float dx, float dy) {
+  return (float)std::sqrt((double)dx * dx + (double)dy * dy);
+}
+
+// Colors the point at (px, py) into out, out[plane] and out[2 * plane]
+inline void weighted_closest(float px, float py, const Sim_Params &sp, unsigned char *out,
+			     size_t plane) {
+  int c = 0;
+  float rgb[3] = {0, 0, 0};
+  float total = 0;
+  float dist = INFINITY;
+  for (int i = 0; i < sp.nmasses; ++i) {
+    float d = color_distance(px - sp.mx[i], py - sp.my[i]);
+    if (d < dist) {
+      c = i % 3;
+      dist = d;
+    } else {
+      total += d;
+    }
+    rgb[i % 3] = d;
+  }
+  for (int i = 0; i < 3; ++i) {
+    // Weights of masses beyond the sum wrap around, as they always have
+    out[i * plane] = i == c ? 255 : (unsigned char)(int32_t)(255 * (total - rgb[i]) / total);
+  }
+}
+
+typedef void (*Color_Kernel)(const float *x, const float *y, int n, const Sim_Params &sp,
+			     unsigned char *out, size_t plane);
+
+// Colors points [begin, n)
+inline void color_span_scalar(const float *x, const float *y, int n, const Sim_Params &sp,
+			      unsigned char *out, size_t plane, int begin = 0) {
+  for (int i = begin; i < n; ++i) {
+    weighted_closest(x[i], y[i], sp, out + i, plane);
+  }
+}
+
+inline void color_span_scalar_kernel(const float *x, const float *y, int n, const Sim_Params &sp,
+				     unsigned char *out, size_t plane) {
+  color_span_scalar(x, y, n, sp, out, plane);
+}
+
+#if GS_X86
+// Like the integration kernels, one body written with vector extensions
+// for float vectors V. VH is half of V, VD the same lanes in double and VB
+// in bytes. The square roots need instructions of their own per target,
+// which can only be inlined into the target's wrapper, so the wrappers are
+// flattened instead of the body being forced inline.
+typedef float v2sf __attribute__((vector_size(8)));
+typedef double v2df __attribute__((vector_size(16)));
+typedef double v4df __attribute__((vector_size(32)));
+typedef double v8df __attribute__((vector_size(64)));
+typedef unsigned char v4qu __attribute__((vector_size(4)));
+typedef unsigned char v8qu __attribute__((vector_size(8)));
+typedef unsigned char v16qu __attribute__((vector_size(16)));
+
+__attribute__((target("sse2")))
+inline void lane_sqrt(v2df &v) {
+  v = (v2df)_mm_sqrt_pd((__m128d)v);
+}
+
+__attribute__((target("avx")))
+inline void lane_sqrt(v4df &v) {
+  v = (v4df)_mm256_sqrt_pd((__m256d)v);
+}
+
+__attribute__((target("avx512f")))
+inline void lane_sqrt(v8df &v) {
+  // The masked form, as _mm512_sqrt_pd() trips -Wmaybe-uninitialized in GCC 12
+  v = (v8df)_mm512_mask_sqrt_pd((__m512d)v, 0xff, (__m512d)v);
+}
+
+// color_distance() of every lane
+template<typename V, typename VH, typename VD>
+inline void lane_distance(const V &dx, const V &dy, V &d) {
+  for (int h = 0; h < 2; ++h) {
+    VH hx, hy;
+    memcpy(&hx, (const char *)&dx + h * sizeof(VH), sizeof(VH));
+    memcpy(&hy, (const char *)&dy + h * sizeof(VH), sizeof(VH));
+    VD x = __builtin_convertvector(hx, VD);
+    VD y = __builtin_convertvector(hy, VD);
+    VD s = (x * x) + (y * y);
+    lane_sqrt(s);
+    VH r = __builtin_convertvector(s, VH);
+    memcpy((char *)&d + h * sizeof(VH), &r, sizeof(VH));
+  }
+}
+
+template<typename V, typename VH, typename VD, typename VB>
+inline void color_span_vector(const float *x, const float *y, int n, const Sim_Params &sp,
+			      unsigned char *out, size_t plane) {
+  typedef decltype(V{} < V{}) VI;
+  const int W = sizeof(V) / sizeof(float);
+  int i = 0;
+  for (; i + W <= n; i += W) {
+    V px, py;
+    memcpy(&px, x + i, sizeof(V));
+    memcpy(&py, y + i, sizeof(V));
+    VI c = {};
+    V rgb[3] = {V{}, V{}, V{}};
+    V total = {};
+    V dist = INFINITY - V{};
+    for (int m = 0; m < sp.nmasses; ++m) {
+      V d;
+      lane_distance<V, VH, VD>(px - sp.mx[m], py - sp.my[m], d);
+      VI closer = d < dist;
+      c = closer ? m % 3 + VI{} : c;
+      dist = closer ? d : dist;
+      total = closer ? total : total + d;
+      rgb[m % 3] = d;
+    }
+    for (int j = 0; j < 3; ++j) {
+      // Truncates to int32 and then to a byte, as the scalar kernel does
+      VI w = __builtin_convertvector(255.0f * (total - rgb[j]) / total, VI);
+      VB b = __builtin_convertvector(c == j ? 255 + VI{} : w, VB);
+      memcpy(out + j * plane + i, &b, sizeof(VB));
+    }
+  }
+  color_span_scalar(x, y, n, sp, out, plane, i);
+}
+
+__attribute__((target("sse2"), flatten))
+inline void color_span_sse2(const float *x, const float *y, int n, const Sim_Params &sp,
+			    unsigned char *out, size_t plane) {
+  color_span_vector<v4sf, v2sf, v2df, v4qu>(x, y, n, sp, out, plane);
+}
+
+__attribute__((target("avx2"), flatten))
+inline void color_span_avx2(const float *x, const float *y, int n, const Sim_Params &sp,
+			    unsigned char *out, size_t plane) {
+  color_span_vector<v8sf, v4sf, v4df, v8qu>(x, y, n, sp, out, plane);
+}
+
+__attribute__((target("avx512f"), flatten))
+inline void color_span_avx512(const float *x, const float *y, int n, const Sim_Params &sp,
+			      unsigned char *out, size_t plane) {
+  color_span_vector<v16sf, v8sf, v8df, v16qu>(x, y, n, sp, out, plane);
+}
+#endif
+
+inline Color_Kernel color_kernel(Simd_Level l) {
+  switch (l) {
+#if GS_X86
+  case SIMD_SSE2: return color_span_sse2;
+  case SIMD_AVX2: return color_span_avx2;
+  case SIMD_AVX512: return color_span_avx512;
+#endif
+  default: return color_span_scalar_kernel;
+  }
+}
+
+#endif
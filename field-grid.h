@@ -0,0 +1,356 @@
+#ifndef GRAVITY_SNAPSHOT_FIELD_GRID_H
+#define GRAVITY_SNAPSHOT_FIELD_GRID_H
+
+#include "integrate.h"
+#include "mapped-file.h"
+#include <algorithm>
+#include <cmath>
+#include <new>
+#include <vector>
+
+enum Field_Sampling {
+  FIELD_BILINEAR,
+  FIELD_BICUBIC
+};
+
+// The masses never move, so their pull is a fixed field over the plane, but
+// one far too steep near the masses to interpolate. So each mass's pull is
+// split in two at the split radius R:
+//   near: pull * (1 - s(r / R)), zero beyond R
+//   far:  pull * s(r / R), smooth everywhere
+// with s the smoothstep t^2 (3 - 2t) rising from 0 at the mass to 1 at R.
+// Field_Grid holds the sum of the far parts at the nodes of a regular grid
+// and, for every cell, the masses whose near part reaches into it. The field
+// kernel interpolates the far part and adds the few near parts exactly,
+// which costs the same for 3 masses as for 3000. Outside the grid the masses
+// are summed directly.
+struct Field_Grid {
+  float x0 = 0; // position of node (0, 0)
+  float y0 = 0;
+  float spacing = 1;
+  int nx = 0;
+  int ny = 0;
+  Field_Sampling sampling = FIELD_BILINEAR;
+  float *a = nullptr;            // far part per node as x, y pairs, row by row
+  int *near_start = nullptr;     // near masses of cell k are entries
+  std::vector<float> near_x;     // [near_start[k], near_start[k + 1])
+  std::vector<float> near_y;
+
+  // Nodes covering [gx0, gx1] x [gy0, gy1], `step` apart. The nodes and
+  // the cell index are allocated from the scratch file f if there is one,
+  // otherwise the heap.
+  Field_Grid(float gx0, float gy0, float gx1, float gy1, float step, Field_Sampling s,
+	     float split_radius, float g, float soft, Mapped_File *f = nullptr)
+    : x0(gx0), y0(gy0), spacing(step), sampling(s), inv_spacing(1 / step),
+      radius(split_radius), inv_radius(1 / split_radius), gravity(g), softening(soft) {
+    nx = (int)nodes(gx0, gx1, step);
+    ny = (int)nodes(gy0, gy1, step);
+    if (f) {
+      a = (float *)f->allocate(2 * cells() * sizeof(float));
+      near_start = (int *)f->allocate((cells() + 1) * sizeof(int));
+      if (!a || !near_start) {
+	throw std::bad_alloc();
+      }
+    } else {
+      heap_nodes.assign(2 * cells(), 0);
+      heap_index.assign(cells() + 1, 0);
+      a = heap_nodes.data();
+      near_start = heap_index.data();
+    }
+  }
+
+  Field_Grid(const Field_Grid &) = delete;
+  Field_Grid &operator=(const Field_Grid &) = delete;
+
+  // Size of the nodes and the cell index of a grid before it is built.
+  // The near masses come on top, on the heap, but are only a few per cell.
+  static size_t fixed_bytes(float gx0, float gy0, float gx1, float gy1, float step) {
+    return (2 * sizeof(float) + sizeof(int)) * nodes(gx0, gx1, step) * nodes(gy0, gy1, step);
+  }
+
+  size_t index(int i, int j) const {
+    return (size_t)j * nx + i;
+  }
+
+  float node_x(int i) const {
+    return x0 + i * spacing;
+  }
+
+  float node_y(int j) const {
+    return y0 + j * spacing;
+  }
+
+  size_t bytes() const {
+    return (cells() * 2 + near_x.size() * 2) * sizeof(float) + (cells() + 1) * sizeof(int);
+  }
+
+  // Average number of near masses per cell
+  float near_per_cell() const {
+    return (float)near_x.size() / cells();
+  }
+
+  // Turns the full field, already stored in a, into its far part
+  // and fills in the near masses of every cell
+  void split(const float *mx, const float *my, int n) {
+    const size_t ncells = cells();
+    std::vector<int> count(ncells + 1, 0);
+    // Every point of a cell is within half a diagonal of its center
+    float reach = radius + spacing * .71f;
+    for (int pass = 0; pass < 2; ++pass) {
+      for (int m = 0; m < n; ++m) {
+	int i0 = std::max(0, (int)floorf((mx[m] - reach - x0) * inv_spacing));
+	int j0 = std::max(0, (int)floorf((my[m] - reach - y0) * inv_spacing));
+	int i1 = std::min(nx - 1, (int)ceilf((mx[m] + reach - x0) * inv_spacing));
+	int j1 = std::min(ny - 1, (int)ceilf((my[m] + reach - y0) * inv_spacing));
+	for (int j = j0; j <= j1; ++j) {
+	  for (int i = i0; i <= i1; ++i) {
+	    const size_t k = index(i, j);
+	    if (pass == 0) {
+	      float fx = 0, fy = 0;
+	      near_pull(mx[m] - node_x(i), my[m] - node_y(j), fx, fy);
+	      a[2 * k] -= fx;
+	      a[2 * k + 1] -= fy;
+	    }
+	    float dx = node_x(i) + spacing / 2 - mx[m];
+	    float dy = node_y(j) + spacing / 2 - my[m];
+	    if (dx * dx + dy * dy > reach * reach) {
+	      continue;
+	    }
+	    if (pass == 0) {
+	      ++count[k + 1];
+	    } else {
+	      int e = count[k]++;
+	      near_x[e] = mx[m];
+	      near_y[e] = my[m];
+	    }
+	  }
+	}
+      }
+      if (pass == 0) {
+	for (size_t k = 0; k < ncells; ++k) {
+	  count[k + 1] += count[k];
+	}
+	std::copy(count.begin(), count.end(), near_start);
+	near_x.resize(count.back());
+	near_y.resize(count.back());
+      }
+    }
+  }
+
+  // The pull at (x, y), or false outside the grid. near is set to the
+  // squared distance of the nearest mass within the split radius, or
+  // infinity if there is none.
+  bool sample(float x, float y, float &xa, float &ya, float &near) const {
+    float u = (x - x0) * inv_spacing;
+    float v = (y - y0) * inv_spacing;
+    // The bicubic stencil needs a node on either side of the cell. Written
+    // so that NaNs fail as well.
+    const float lo = sampling == FIELD_BICUBIC ? 1 : 0;
+    const float hi = sampling == FIELD_BICUBIC ? 2 : 1;
+    if (!(u >= lo && v >= lo && u < nx - hi && v < ny - hi)) {
+      return false;
+    }
+    int i = (int)u, j = (int)v;
+    const size_t k = index(i, j);
+    float tx = u - i, ty = v - j;
+    float sx = 0, sy = 0;
+    if (sampling == FIELD_BILINEAR) {
+      const float *top = a + 2 * k, *bottom = top + 2 * nx;
+      float x_top = top[0] + (top[2] - top[0]) * tx;
+      float x_bottom = bottom[0] + (bottom[2] - bottom[0]) * tx;
+      float y_top = top[1] + (top[3] - top[1]) * tx;
+      float y_bottom = bottom[1] + (bottom[3] - bottom[1]) * tx;
+      sx = x_top + (x_bottom - x_top) * ty;
+      sy = y_top + (y_bottom - y_top) * ty;
+    } else {
+      // Catmull-Rom over the 4 x 4 nodes around the cell
+      float wx[4], wy[4];
+      catmull_rom(tx, wx);
+      catmull_rom(ty, wy);
+      const float *row = a + 2 * (k - nx - 1);
+      for (int r = 0; r < 4; ++r) {
+	float rx = 0, ry = 0;
+	for (int c = 0; c < 4; ++c) {
+	  rx += row[2 * c] * wx[c];
+	  ry += row[2 * c + 1] * wx[c];
+	}
+	sx += rx * wy[r];
+	sy += ry * wy[r];
+	row += 2 * nx;
+      }
+    }
+    float nearest = INFINITY;
+    for (int e = near_start[k]; e < near_start[k + 1]; ++e) {
+      nearest = std::min(nearest, near_pull(near_x[e] - x, near_y[e] - y, sx, sy));
+    }
+    xa = sx;
+    ya = sy;
+    near = nearest;
+    return true;
+  }
+
+  bool sample(float x, float y, float &xa, float &ya) const {
+    float near;
+    return sample(x, y, xa, ya, near);
+  }
+
+private:
+  static size_t nodes(float lo, float hi, float step) {
+    return (size_t)ceilf((hi - lo) / step) + 1;
+  }
+
+  size_t cells() const {
+    return (size_t)nx * ny;
+  }
+
+  // Adds the near part of the pull of a mass at offset (dx, dy), returns
+  // the squared distance or infinity beyond the split radius
+  float near_pull(float dx, float dy, float &fx, float &fy) const {
+    float d = (dx * dx) + (dy * dy);
+    if (d >= radius * radius) {
+      return INFINITY;
+    }
+    float t = sqrtf(d) * inv_radius;
+    float f = gravity / (d + softening) * (1 - t * t * (3 - 2 * t));
+    fx += dx * f;
+    fy += dy * f;
+    return d;
+  }
+
+  static void catmull_rom(float t, float *w) {
+    w[0] = ((-t + 2) * t - 1) * t / 2;
+    w[1] = ((3 * t - 5) * t * t + 2) / 2;
+    w[2] = ((-3 * t + 4) * t + 1) * t / 2;
+    w[3] = (t - 1) * t * t / 2;
+  }
+
+  float inv_spacing;
+  float radius;
+  float inv_radius;
+  float gravity;
+  float softening;
+  std::vector<float> heap_nodes; // back a and near_start without a scratch file
+  std::vector<int> heap_index;
+};
+
+// The pull outside the grid: through the quadtree if there is one,
+// otherwise summed over every mass. With the tree, near is measured to the
+// masses and cells on the point's interaction list.
+inline void accelerate_direct(float x, float y, float &xa, float &ya, float &near,
+			      const Sim_Params &sp) {
+  if (!sp.tree) {
+    accelerate<0>(x, y, xa, ya, near, sp.mx, sp.my, sp);
+    return;
+  }
+  static thread_local Interaction_List list;
+  sp.tree->interactions(x, y, x, y, list);
+  float xacc = 0;
+  float yacc = 0;
+  float nearest = INFINITY;
+  for (int m = 0; m < list.size(); ++m) {
+    float dx = list.x[m] - x;
+    float dy = list.y[m] - y;
+    float d = (dx * dx) + (dy * dy);
+    float f = list.g[m] / (d + sp.softening);
+    xacc += dx * f;
+    yacc += dy * f;
+    nearest = std::min(nearest, d);
+  }
+  xa = xacc;
+  ya = yacc;
+  near = nearest;
+}
+
+inline void accelerate_direct(float x, float y, float &xa, float &ya, const Sim_Params &sp) {
+  float near;
+  accelerate_direct(x, y, xa, ya, near, sp);
+}
+
+// The pull at a point through the grid, or past its edges without it
+inline void accelerate_field(float x, float y, float &xa, float &ya, float &near,
+			     const Sim_Params &sp) {
+  if (!sp.field->sample(x, y, xa, ya, near)) {
+    accelerate_direct(x, y, xa, ya, near, sp);
+  }
+}
+
+
+// State of up to INTERLEAVE particles for the integrator policy, pulled
+// through the grid where it covers them
+struct Field_Group {
+  static const int G = INTERLEAVE;
+  float x[G], y[G], xv[G], yv[G], xa[G], ya[G], near[G];
+  int n;
+  const Sim_Params &sp;
+
+  Field_Group(int count, const Sim_Params &params) : n(count), sp(params) {}
+
+  int size() const {
+    return n;
+  }
+
+  __attribute__((always_inline)) void drift(float c) {
+    const float h = c * sp.dt;
+    for (int k = 0; k < n; ++k) {
+      x[k] += xv[k] * h;
+      y[k] += yv[k] * h;
+    }
+  }
+
+  __attribute__((always_inline)) void kick(float c) {
+    const float h = c * sp.dt;
+    for (int k = 0; k < n; ++k) {
+      xv[k] += xa[k] * h;
+      yv[k] += ya[k] * h;
+    }
+  }
+
+  __attribute__((always_inline)) void pull() {
+    for (int k = 0; k < n; ++k) {
+      accelerate_field(x[k], y[k], xa[k], ya[k], near[k], sp);
+    }
+  }
+};
+
+// Kernel for -field. The grid lookups are scalar, so every -simd level uses
+// this same kernel. A lookup is a chain of dependent loads, so like the
+// interleaved kernel it steps INTERLEAVE particles side by side to have
+// several chains in flight at once.
+template<typename P>
+void integrate_span_field(const Span &s, int steps, const Sim_Params &sp) {
+  const int G = INTERLEAVE;
+  for (int i = 0; i < s.n; i += G) {
+    Field_Group f(std::min(G, s.n - i), sp);
+    for (int k = 0; k < f.n; ++k) {
+      f.x[k] = s.x[i + k];
+      f.y[k] = s.y[i + k];
+      f.xv[k] = s.xv[i + k];
+      f.yv[k] = s.yv[i + k];
+      f.xa[k] = s.xa[i + k];
+      f.ya[k] = s.ya[i + k];
+    }
+    find_near(f);
+    for (int j = 0; j < steps; ++j) {
+      step_encounters<P>(f);
+    }
+    for (int k = 0; k < f.n; ++k) {
+      s.x[i + k] = f.x[k];
+      s.y[i + k] = f.y[k];
+      s.xv[i + k] = f.xv[k];
+      s.yv[i + k] = f.yv[k];
+      s.xa[i + k] = f.xa[k];
+      s.ya[i + k] = f.ya[k];
+    }
+  }
+}
+
+template<typename P>
+inline Span_Kernel field_span_kernel() {
+  return integrate_span_field<P>;
+}
+
+inline Span_Kernel field_span_kernel(Integrator i = INTEGRATOR_EULER) {
+  GS_POLICY_DISPATCH(field_span_kernel, i, ())
+}
+
+#endif
@@ -0,0 +1,135 @@
+#ifndef GRAVITY_SNAPSHOT_FRAME_WRITER_H
+#define GRAVITY_SNAPSHOT_FRAME_WRITER_H
+
+#include "CImg.h"
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Encodes and writes frames on background threads so the renderer can start
+// on frame N+1 while frame N is being saved. submit() copies the frame into
+// a recycled buffer and returns immediately unless max_in_flight frames are
+// already queued or being written, in which case it waits for one to finish.
+// That bounds the memory used to max_in_flight frame buffers.
+//
+// With zero writer threads frames are saved synchronously inside submit().
+class Frame_Writer {
+public:
+  typedef std::function<bool(const cimg_library::CImg<unsigned char> &img, int number)> Save_Fn;
+
+  Frame_Writer(int nwriters, int max_in_flight, Save_Fn save_fn)
+    : save(save_fn), capacity(std::max(1, max_in_flight)) {
+    for (int i = 0; i < nwriters; ++i) {
+      threads.emplace_back(&Frame_Writer::writer_loop, this);
+    }
+  }
+
+  ~Frame_Writer() {
+    finish();
+  }
+
+  Frame_Writer(const Frame_Writer &) = delete;
+  Frame_Writer &operator=(const Frame_Writer &) = delete;
+
+  // Returns false once any frame has failed to save
+  bool submit(const cimg_library::CImg<unsigned char> &img, int number) {
+    if (threads.empty()) {
+      if (!save(img, number)) {
+	failed = true;
+      }
+      return !failed;
+    }
+
+    std::unique_lock<std::mutex> lock(mutex);
+    space.wait(lock, [this] { return in_flight < capacity; });
+    ++in_flight;
+    Job job;
+    job.number = number;
+    if (!free_buffers.empty()) {
+      job.img.swap(free_buffers.back());
+      free_buffers.pop_back();
+    }
+    lock.unlock();
+    job.img.assign(img); // reuses the buffer's storage when the size matches
+    lock.lock();
+    queue.emplace_back();
+    queue.back().number = job.number;
+    queue.back().img.swap(job.img);
+    ready.notify_one();
+    return !failed;
+  }
+
+  // Waits for every submitted frame to be written. Returns false if any
+  // frame failed to save.
+  bool drain() {
+    std::unique_lock<std::mutex> lock(mutex);
+    space.wait(lock, [this] { return in_flight == 0; });
+    return !failed;
+  }
+
+  // Waits for every submitted frame to be written and stops the writer
+  // threads. Returns false if any frame failed to save.
+  bool finish() {
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      space.wait(lock, [this] { return in_flight == 0; });
+      stopping = true;
+    }
+    ready.notify_all();
+    for (auto &t : threads) {
+      t.join();
+    }
+    threads.clear();
+    return !failed;
+  }
+
+private:
+  struct Job {
+    cimg_library::CImg<unsigned char> img;
+    int number = 0;
+  };
+
+  void writer_loop() {
+    while (true) {
+      Job job;
+      {
+	std::unique_lock<std::mutex> lock(mutex);
+	ready.wait(lock, [this] { return stopping || !queue.empty(); });
+	if (queue.empty()) {
+	  return;
+	}
+	job.number = queue.front().number;
+	job.img.swap(queue.front().img);
+	queue.pop_front();
+      }
+      bool ok = save(job.img, job.number);
+      {
+	std::lock_guard<std::mutex> lock(mutex);
+	if (!ok) {
+	  failed = true;
+	}
+	free_buffers.emplace_back();
+	free_buffers.back().swap(job.img);
+	--in_flight;
+      }
+      space.notify_all();
+    }
+  }
+
+  Save_Fn save;
+  int capacity;
+  std::vector<std::thread> threads;
+  std::mutex mutex;
+  std::condition_variable ready;
+  std::condition_variable space;
+  std::deque<Job> queue;
+  std::vector<cimg_library::CImg<unsigned char> > free_buffers;
+  int in_flight = 0;
+  bool stopping = false;
+  bool failed = false;
+};
+
+#endif
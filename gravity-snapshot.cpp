@@ -1,9 +1,27 @@
 #include "CImg.h"
+#include "integrate.h"
+#include "field-grid.h"
+#include "adaptive.h"
+#include "precision.h"
+#include "color.h"
+#include "checkpoint.h"
+#include "positions.h"
+#include "particles.h"
+#include "frame-writer.h"
+#include "png-writer.h"
+#include "video-stream.h"
+#include "symmetry.h"
+#include "thread-pool.h"
 #include <random>
+#include <csignal>
 #include <string>
+#include <strings.h>
 #include <sys/stat.h>
 #include <iostream>
 #include <iomanip>
+#include <memory>
+#include <functional>
+#include <chrono>
 #include <ctime>
 #include <sstream>
 
@@ -17,6 +35,8 @@ using namespace cimg_library;
 int width = 500;
 int height = 500;
 float gravity = 30.0;
+// Added to the squared distance in the pull gravity * d / (d^2 + softening)
+float softening = 0.1;
 int triangle_height = 200;
 float dt = 0.1;
 int num_rand = 3;
@@ -33,6 +53,97 @@ struct Mass {
 std::vector<Mass> masses;
 int nmasses = 3;
 
+// Kernel view of the masses and constants, refreshed by init_masses
+std::vector<float> mass_x, mass_y;
+Sim_Params sim;
+
+// Far field radius (-far-field) around the masses' center, 0 when disabled.
+// Outside of it the masses are treated as one combined mass at their center.
+// With all masses within a of the center and q = a / R, the first dropped
+// term of the multipole expansion of the exact sum is O(q^2) and the
+// relative error of the force is at most q^2 / (1 - q), plus about
+// softening / R^2.
+float far_field_radius = 0;
+float mass_spread = 0;
+
+// Set by SIGINT and SIGTERM while checkpointing, which then stops the run
+// after the current frames with a last checkpoint
+volatile sig_atomic_t stop_signal = 0;
+
+void on_stop_signal(int sig) {
+  stop_signal = sig;
+}
+
+float far_field_error(float radius) {
+  float q = mass_spread / radius;
+  return q * q / (1 - q) + softening / (radius * radius);
+}
+
+// Close encounters (-encounter): within encounter_radius of a mass every
+// step is split into encounter_steps substeps. 0 disables it.
+float encounter_radius = 0;
+int encounter_steps = 8;
+
+// Barnes-Hut opening angle (-theta) and the number of masses from which the
+// quadtree replaces the direct sum (-tree-masses). A theta of 0 disables it.
+float tree_theta = .5;
+int tree_masses = 256;
+std::unique_ptr<Quadtree> mass_tree;
+
+// Precomputed acceleration field (-field). The grid covers the frame and
+// FIELD_MARGIN of its size beyond each edge; past that the masses are summed
+// directly. field_near is the split radius between the exact and the
+// interpolated part of each mass's pull.
+bool use_field = false;
+Field_Sampling field_sampling = FIELD_BILINEAR;
+float field_spacing = .5;
+float field_near = 4;
+const float FIELD_MARGIN = .25;
+std::unique_ptr<Field_Grid> field_grid;
+
+Span_Kernel integrate_kernel = integrate_span_scalar_kernel<0, Euler_Step>;
+// Number type of the particles' state (-precision, see precision.h)
+Precision precision = PRECISION_FLOAT;
+
+void update_sim_params() {
+  mass_x.clear();
+  mass_y.clear();
+  for (const Mass &m : masses) {
+    mass_x.push_back(m.x);
+    mass_y.push_back(m.y);
+  }
+  sim.mx = mass_x.data();
+  sim.my = mass_y.data();
+  sim.nmasses = masses.size();
+  sim.gravity = gravity;
+  sim.dt = dt;
+  sim.softening = softening;
+  sim.encounter_r2 = encounter_radius * encounter_radius;
+  sim.encounter_steps = encounter_steps;
+
+  float cx = 0, cy = 0;
+  for (const Mass &m : masses) {
+    cx += m.x / masses.size();
+    cy += m.y / masses.size();
+  }
+  mass_spread = 0;
+  for (const Mass &m : masses) {
+    mass_spread = std::max(mass_spread, hypotf(m.x - cx, m.y - cy));
+  }
+  sim.far_field = far_field_radius > 0;
+  sim.far_x = cx;
+  sim.far_y = cy;
+  sim.far_r2 = far_field_radius * far_field_radius;
+  sim.far_gravity = gravity * masses.size();
+
+  mass_tree.reset();
+  // The wider types always sum over every mass
+  if (precision == PRECISION_FLOAT && tree_theta > 0 && (int)masses.size() >= tree_masses) {
+    mass_tree.reset(new Quadtree(sim.mx, sim.my, sim.nmasses, gravity, tree_theta));
+  }
+  sim.tree = mass_tree.get();
+}
+
 unsigned char red[] = { 167, 38, 8 }, green[] = { 122, 179, 131 }, blue[] = {118, 120, 219}, color[] = {0,0,0};
 unsigned char *colors[] = {red, green, blue};
 
@@ -96,6 +207,7 @@ void init_masses(Mass_Layout l) {
     break;
   }   
   }
+  update_sim_params();
 }
 
 struct Point {
@@ -132,37 +244,105 @@ void print_help() {
 	 "   -shape-size [int]     height for triangle, width for line\n"
 	 "   -dt [float]          the time step between frames\n"
 	 "   -gravity [float]     the force of gravity\n"
+	 "   -softening [float]   added to the squared distance in the pull, which keeps it\n"
+	 "                        finite at the masses. Default is 0.1\n"
 	 "   -i [int]             the initial number of iterations per frame, default is 100\n"
 	 "   -step [int]          by how much the number of iterations increases per frame, default is 10\n"
+	 "   -threads [int]       number of render threads, default is the number of cores\n"
+	 "   -batch [int]         render this many frames per pass over the particles. Keeps\n"
+	 "                        each particle in cache across the frames, at the cost of one\n"
+	 "                        image buffer per frame. Default is 1\n"
+	 "   -capture [float r] [int k]   stop integrating a pixel once it has been bound\n"
+	 "                        within distance r of a mass for k checks in a row.\n"
+	 "                        Faster, but the pixel's color stops changing\n"
+	 "   -capture-interval [int]   steps between capture checks, default is 32\n"
+	 "   -far-field [float]   beyond this distance from the masses' center, pull points\n"
+	 "                        in with one combined mass instead of every mass. Use -v to\n"
+	 "                        see the resulting error bound. 0 (default) disables it\n"
+	 "   -theta [float]       Barnes-Hut opening angle for many masses: 0 sums every\n"
+	 "                        mass exactly, larger is faster but less exact. Default is 0.5,\n"
+	 "                        see -bench for the trade off\n"
+	 "   -tree-masses [int]   use the Barnes-Hut quadtree from this many masses on,\n"
+	 "                        default is 256\n"
+	 "   -field [sampling]    precompute the masses' pull on a grid and interpolate it\n"
+	 "                        instead of summing over the masses every step. sampling\n"
+	 "                        is bilinear or bicubic. Pays off with many masses\n"
+	 "   -field-spacing [float]   distance between grid nodes in pixels, default is 0.5\n"
+	 "   -field-near [float]  within this distance of a mass its pull is too steep to\n"
+	 "                        interpolate and is computed exactly, default is 4\n"
+	 "   -no-symmetry         integrate every pixel even if the masses are laid out\n"
+	 "                        symmetrically. By default only one pixel of each mirror\n"
+	 "                        image is integrated\n"
+	 "   -integrator [type]   euler (default) takes fixed steps of -dt. verlet, yoshida\n"
+	 "                        (Forest-Ruth) and pefrl also do, but keep the energy\n"
+	 "                        bounded and are 2nd, 4th and 4th order. yoshida costs 3\n"
+	 "                        and pefrl 4 times as much per step. dopri takes steps of\n"
+	 "                        its own size for every pixel, small only where the path\n"
+	 "                        bends sharply. -i and -step then count units of -dt of\n"
+	 "                        simulated time. See -bench for the trade off\n"
+	 "   -tol [float]         largest error per step dopri accepts, in pixels, default 0.001\n"
+	 "   -encounter [float r] [int k]   points within distance r of a mass take each\n"
+	 "                        step as k smaller ones, so the pull's steep rise near the\n"
+	 "                        masses does not force a small -dt everywhere. r should be\n"
+	 "                        more than a step's travel. dopri adapts its steps anyway\n"
+	 "   -precision [type]    float (default), double or fixed: the number type the\n"
+	 "                        points' state is kept in. double and fixed (32.32 bits)\n"
+	 "                        take longer but round less over long runs, and fixed\n"
+	 "                        gives the same output on any CPU. Always sums over every\n"
+	 "                        mass, and does not go with dopri or -field\n"
+	 "   -compact             keep each point's state in 8 bytes instead of 24 between\n"
+	 "                        frames, for very large frames. It is rounded to half\n"
+	 "                        precision after every -batch of frames, so a single batch\n"
+	 "                        renders exactly as without it. Not with -precision\n"
+	 "   -memory [MB]         memory the points' state, the -field grid and the frames\n"
+	 "                        may take. Beyond it they are kept in a scratch file and\n"
+	 "                        rendered in bands of rows, which allows frames larger\n"
+	 "                        than the RAM. PNG frames are then written band by band,\n"
+	 "                        never whole.\n"
+	 "                        Default is 3/4 of the physical memory\n"
+	 "   -scratch [directory] where the scratch file goes, default is the save directory\n"
+	 "   -positions           also save where every point ends up in each frame, to a\n"
+	 "                        .gsp file next to it, which recolor can color again\n"
+	 "                        without integrating. With -compact those are rounded to\n"
+	 "                        half precision. Renders one frame per -batch\n"
+	 "   -checkpoint [file]   save the state of the run to file every few minutes, and\n"
+	 "                        when it is stopped with Ctrl-C or SIGTERM. Saving forks\n"
+	 "                        the process, which may briefly take up to twice the memory\n"
+	 "   -checkpoint-interval [seconds]   time between checkpoints, default is 300\n"
+	 "   -resume [file]       continue the run saved in a checkpoint file, with the\n"
+	 "                        options it was started with. Options given as well\n"
+	 "                        override those, as in -resume run.gsc -frames 1000.\n"
+	 "                        Keeps checkpointing to file unless -checkpoint is given,\n"
+	 "                        and numbers and saves the frames like the run did\n"
+	 "                        unless given -save-in or -g\n"
+	 "   -simd [level]        scalar, interleaved, sse2, avx2, avx512, or auto (default)\n"
+	 "                        to pick the widest one the CPU supports. All give identical output\n"
 	 "\n   -ns                No save. Don't save the frames\n"
 	 "   -name [filename]     basefile name\n"
+	 "   -compression [0-9]   PNG compression level, 0 stores uncompressed for speed,\n"
+	 "                        9 is smallest, default is 6\n"
+	 "   -writers [int]       threads saving frames in the background while the next ones\n"
+	 "                        render, default is 1. 0 saves each frame before continuing\n"
+	 "   -queue [int]         most frames waiting to be saved at once, default is 4\n"
+	 "   -stream [format] [path]   write all frames into one video stream instead of\n"
+	 "                        image files. format is y4m or rgb (raw RGB24), path can\n"
+	 "                        be a FIFO, or - for stdout\n"
+	 "   -fps [int]           frame rate stored in y4m streams, default is 30\n"
 	 "   -save-in [directory]       save directory\n"
 	 "   -g                   generate directory from timestamp\n"
 	 "                        when the -o flag is also present the generated directory\n"
 	 "                        will be a child of the given directory\n\n"
+	 "   -headless            don't open a window, exit once the frames are rendered.\n"
+	 "                        Implied when there is no X display or in the gs-headless build\n"
 	 "   -interactive         show the gravity simulation\n"
+	 "   -bench               time each integration kernel on this machine and exit\n"
 	 "\n   -help, --help        show this help info\n"
     );
   exit(1);
 }
 
 void Point::update() {
-  x += xv * dt;
-  y += yv * dt;
-  xv += xa * dt;
-  yv += ya * dt;
-  float xacc = 0;
-  float yacc = 0;
-  for (auto m : masses) {
-    float dx = m.x - x;
-    float dy = m.y - y;
-    float d = (dx * dx) + (dy * dy);
-    float f = gravity / (d + .1);
-    xacc += dx * f;
-    yacc += dy * f;
-  }
-  xa = xacc;
-  ya = yacc;
+  integrate(x, y, xv, yv, xa, ya, sim);
 }
 
 void interactive_mode() {  
@@ -214,70 +394,749 @@ void interactive_mode() {
   }
 }
 
-void calc_closest(Point *p) {
+void calc_closest(float px, float py, unsigned char *out) {
   int c = 0;
   float dist = INFINITY;
   // for (int m = 0; m < nmasses; ++m) {
   int i = 0;
   for (auto m : masses) {
     // float d = hypotf(p->x - masses[m][0], p->y - masses[m][1]);
-    float d = abs(p->x - m.x) + abs(p->y - m.y);
+    float d = abs(px - m.x) + abs(py - m.y);
     if (d < dist) {
       dist = d;
       c = i % 3;
     }
     ++i;
   }
-  color[0] = colors[c][0];
-  color[1] = colors[c][1];
-  color[2] = colors[c][2];
+  out[0] = colors[c][0];
+  out[1] = colors[c][1];
+  out[2] = colors[c][2];
 }
 
-void calc_weighted_closest(Point *p) {
-  int c = 0;
-  float rgb[3];
-  float total = 0;
-  float dist = INFINITY;
+// Colors spans of points into the frames (see color.h)
+Color_Kernel coloring_kernel = color_span_scalar_kernel;
 
-  // for (int m = 0; m < nmasses; ++m) {
-  for (int i = 0; i < nmasses; ++i) {
-    auto m = masses[i];
-    float d = hypotf(p->x - m.x, p->y - m.y);
-    // printf("%f\n",d);
-    if (d < dist) {
-      c = i % 3;
-      dist = d;
-    } else {
-      total += d;
+// Capture detection (-capture). A particle inside capture_radius of its
+// nearest mass that, counting only that mass's potential, lacks the energy
+// to climb back out to capture_radius is bound to it. Once that holds for
+// capture_checks checks in a row the particle is frozen where it is, its
+// capturing mass and the step are recorded, and it is never integrated
+// again. The checks happen every capture_interval steps.
+float capture_radius = 0;
+int capture_checks = 0;
+int capture_interval = 32;
+// Particles are skipped in chunks, wide enough for one AVX-512 batch
+const int CAPTURE_CHUNK = 16;
+
+// Mass the particle is bound to, or -1
+int bound_mass(float x, float y, float xv, float yv) {
+  int nearest = -1;
+  float nearest_d = INFINITY;
+  for (int m = 0; m < sim.nmasses; ++m) {
+    float dx = sim.mx[m] - x;
+    float dy = sim.my[m] - y;
+    float d = dx * dx + dy * dy;
+    if (d < nearest_d) {
+      nearest_d = d;
+      nearest = m;
     }
-    // total += d;
-    rgb[i % 3] = d;
   }
-  for (int i = 0; i < 3; ++i) {
-    if (i == c) {
-      color[i] = 255;
+  float r = capture_radius * capture_radius;
+  if (nearest_d >= r) {
+    return -1;
+  }
+  // The force gravity * d / (d^2 + softening) comes from the potential
+  // gravity / 2 * ln(d^2 + softening)
+  float v = xv * xv + yv * yv;
+  return v < gravity * logf((r + softening) / (nearest_d + softening)) ? nearest : -1;
+}
+
+// integrate_kernel for runs with capture detection. Captured particles keep
+// their state and chunks without any free particles left are skipped.
+// step0 is the number of steps integrated before this call.
+void integrate_captures(Particles &p, int px, int py, const Span &s, int steps, long long step0) {
+  const size_t base = p.index(px, py);
+  for (int c0 = 0; c0 < s.n; c0 += CAPTURE_CHUNK) {
+    const int cn = std::min(CAPTURE_CHUNK, s.n - c0);
+    Span cs = {s.x + c0, s.y + c0, s.xv + c0, s.yv + c0, s.xa + c0, s.ya + c0, cn,
+	       s.h ? s.h + c0 : nullptr,
+	       s.wide ? (unsigned char *)s.wide + c0 * p.wide_size : nullptr};
+    int32_t *captured = p.captured + base + c0;
+    int free_particles = 0;
+    for (int i = 0; i < cn; ++i) {
+      free_particles += captured[i] < 0;
+    }
+
+    long long t = step0;
+    int left = steps;
+    while (left > 0 && free_particles > 0) {
+      int n = std::min<long long>(left, capture_interval - t % capture_interval);
+      float frozen[CAPTURE_CHUNK][6];
+      unsigned char frozen_wide[CAPTURE_CHUNK][MAX_WIDE_SIZE];
+      unsigned char *wide = (unsigned char *)cs.wide;
+      if (free_particles < cn) {
+	for (int i = 0; i < cn; ++i) {
+	  if (captured[i] >= 0) {
+	    float state[6] = {cs.x[i], cs.y[i], cs.xv[i], cs.yv[i], cs.xa[i], cs.ya[i]};
+	    memcpy(frozen[i], state, sizeof(state));
+	    if (wide) {
+	      memcpy(frozen_wide[i], wide + i * p.wide_size, p.wide_size);
+	    }
+	  }
+	}
+      }
+      integrate_kernel(cs, n, sim);
+      if (free_particles < cn) {
+	for (int i = 0; i < cn; ++i) {
+	  if (captured[i] >= 0) {
+	    cs.x[i] = frozen[i][0];
+	    cs.y[i] = frozen[i][1];
+	    cs.xv[i] = frozen[i][2];
+	    cs.yv[i] = frozen[i][3];
+	    cs.xa[i] = frozen[i][4];
+	    cs.ya[i] = frozen[i][5];
+	    if (wide) {
+	      memcpy(wide + i * p.wide_size, frozen_wide[i], p.wide_size);
+	    }
+	  }
+	}
+      }
+      t += n;
+      left -= n;
+
+      if (t % capture_interval != 0) {
+	continue;
+      }
+      for (int i = 0; i < cn; ++i) {
+	if (captured[i] >= 0) {
+	  continue;
+	}
+	size_t k = base + c0 + i;
+	int m = bound_mass(cs.x[i], cs.y[i], cs.xv[i], cs.yv[i]);
+	if (m < 0) {
+	  p.bound_checks[k] = 0;
+	} else if (++p.bound_checks[k] >= capture_checks) {
+	  captured[i] = m;
+	  p.capture_step[k] = t;
+	  --free_particles;
+	}
+      }
+    }
+  }
+}
+
+// Frames are split into TILE_SIZE x TILE_SIZE tiles which the thread pool
+// integrates in parallel. Every pixel's particle is independent of the others
+// so the result does not depend on the number of threads.
+const int TILE_SIZE = 64;
+
+// Symmetries of the mass layout (see symmetry.h), empty if -no-symmetry
+Symmetry symmetry;
+
+// Compact particle state (-compact, see Particles). The pull is not kept
+// but recomputed by pull_kernel whenever a row is unpacked: after the first
+// frame, and from the start if the integrator expects it there already.
+// pull_kernel is null for integrators that do not use it.
+bool compact = false;
+Span_Kernel pull_kernel = nullptr;
+bool pull_from_start = false;
+
+// Advances s, particles x0 onwards of row y, by `steps` steps
+void advance_run(Particles &p, const Span &s, int x0, int y, int steps, long long step0) {
+  if (p.captured) {
+    integrate_captures(p, x0, y, s, steps, step0);
+  } else {
+    integrate_kernel(s, steps, sim);
+  }
+}
+
+// Sets pixel (x, y) of img, without draw_point()'s checks
+inline void put_pixel(CImg<unsigned char> &img, int x, int y, const unsigned char *c) {
+  const size_t plane = (size_t)img.width() * img.height();
+  unsigned char *d = img.data(x, y);
+  d[0] = c[0];
+  d[plane] = c[1];
+  d[2 * plane] = c[2];
+}
+
+// Hands the -precision state of particle i on to particle k, its image
+// under e
+template<typename T>
+void mirror_wide(Particles &p, size_t i, size_t k, const Symmetry::Element &e) {
+  Wide_Particle<T> *w = (Wide_Particle<T> *)p.wide;
+  Wide_Particle<T> q = w[i];
+  symmetry.map_position(e, q.x, q.y);
+  symmetry.map_vector(e, q.xv, q.yv);
+  symmetry.map_vector(e, q.xa, q.ya);
+  w[k] = q;
+}
+
+// Hands the state of the source pixel (px, py) on to its mirror images
+void mirror_particle(Particles &p, int px, int py) {
+  const size_t i = p.index(px, py);
+  for (const Symmetry::Element &e : symmetry.elements) {
+    int qx, qy;
+    if (!symmetry.map_pixel(e, px, py, qx, qy) || (qx == px && qy == py)) {
+      continue;
+    }
+    const size_t k = p.index(qx, qy);
+    if (p.packed) {
+      p.mirror_packed(i, k, e.flip_x, e.flip_y);
     } else {
-      color[i] = (char)(255 * (total-rgb[i])/total);
+      p.x[k] = p.x[i];
+      p.y[k] = p.y[i];
+      p.xv[k] = p.xv[i];
+      p.yv[k] = p.yv[i];
+      p.xa[k] = p.xa[i];
+      p.ya[k] = p.ya[i];
+      symmetry.map_position(e, p.x[k], p.y[k]);
+      symmetry.map_vector(e, p.xv[k], p.yv[k]);
+      symmetry.map_vector(e, p.xa[k], p.ya[k]);
+    }
+    if (p.step_size) {
+      p.step_size[k] = p.step_size[i];
+    }
+    if (p.wide && precision == PRECISION_DOUBLE) {
+      mirror_wide<double>(p, i, k, e);
+    } else if (p.wide && precision == PRECISION_FIXED) {
+      mirror_wide<Fixed>(p, i, k, e);
+    }
+    if (p.captured) {
+      p.captured[k] = p.captured[i] < 0 ? -1 : e.perm[p.captured[i]];
+      p.capture_step[k] = p.capture_step[i];
+      p.bound_checks[k] = p.bound_checks[i];
+    }
+  }
+}
+
+// Advances the tile by lead_steps, then renders nframes consecutive frames,
+// `steps` steps apart, into imgs. Each row of the tile is carried through
+// all of the frames before moving on to the next, so with several frames its
+// particles stay in L1 and only the colors go out to memory, instead of the
+// whole particle grid being swept through once per frame.
+//
+// With a symmetric layout only the source pixels are integrated. Each one
+// also colors its mirror images from its mirrored position, which permutes
+// the color channels along with the masses, and hands them its state once
+// the frames are done.
+//
+// Compact particles are unpacked for the duration of the row, so they are
+// only rounded to half precision between calls.
+//
+// imgs hold the frames' rows from row0 on, mirror images beyond them are
+// left out.
+void render_tile(Particles &p, CImg<unsigned char> *const *imgs, int row0, int nframes,
+		 int lead_steps, int steps, long long step0, int tile) {
+  int tiles_x = (width + TILE_SIZE - 1) / TILE_SIZE;
+  int x0 = (tile % tiles_x) * TILE_SIZE;
+  int y0 = (tile / tiles_x) * TILE_SIZE;
+  int x1 = std::min(x0 + TILE_SIZE, width);
+  int y1 = std::min(y0 + TILE_SIZE, height);
+  float unpacked[6 * TILE_SIZE];
+  float mirror_x[TILE_SIZE], mirror_y[TILE_SIZE];
+  unsigned char mirror_rgb[3 * TILE_SIZE];
+  Sim_Params rest = sim;
+  rest.dt = 0;
+
+  for (int y = y0; y < y1; ++y) {
+    // Runs [start, end) of source pixels in this row of the tile
+    int runs[TILE_SIZE][2];
+    int nruns = 0;
+    for (int x = x0; x < x1; ++x) {
+      if (!symmetry.is_source(x, y)) {
+	continue;
+      }
+      if (nruns > 0 && runs[nruns - 1][1] == x) {
+	++runs[nruns - 1][1];
+      } else {
+	runs[nruns][0] = x;
+	runs[nruns][1] = x + 1;
+	++nruns;
+      }
+    }
+
+    Span spans[TILE_SIZE];
+    for (int r = 0; r < nruns; ++r) {
+      if (p.packed) {
+	spans[r] = p.unpack_row(y, runs[r][0], runs[r][1], unpacked + (runs[r][0] - x0), TILE_SIZE);
+	if (pull_kernel && (step0 > 0 || pull_from_start)) {
+	  pull_kernel(spans[r], 1, rest);
+	}
+      } else {
+	spans[r] = p.row(y, runs[r][0], runs[r][1]);
+      }
+    }
+
+    for (int r = 0; r < nruns; ++r) {
+      if (lead_steps > 0) {
+	advance_run(p, spans[r], runs[r][0], y, lead_steps, step0);
+      }
+    }
+    for (int f = 0; f < nframes; ++f) {
+      const size_t plane = (size_t)imgs[f]->width() * imgs[f]->height();
+      for (int r = 0; r < nruns; ++r) {
+	const Span &s = spans[r];
+	advance_run(p, s, runs[r][0], y, steps, step0 + lead_steps + (long long)f * steps);
+	coloring_kernel(s.x, s.y, s.n, sim, imgs[f]->data(runs[r][0], y - row0), plane);
+	for (const Symmetry::Element &e : symmetry.elements) {
+	  // The mirror images of the run lie in one row, reversed if flipped in x
+	  const int qy = e.flip_y ? symmetry.axis_y2 - y : y;
+	  if (qy < 0 || qy >= height || qy < row0 || qy - row0 >= imgs[f]->height()) {
+	    continue;
+	  }
+	  for (int i = 0; i < s.n; ++i) {
+	    mirror_x[i] = s.x[i];
+	    mirror_y[i] = s.y[i];
+	    symmetry.map_position(e, mirror_x[i], mirror_y[i]);
+	  }
+	  coloring_kernel(mirror_x, mirror_y, s.n, sim, mirror_rgb, TILE_SIZE);
+	  for (int i = 0; i < s.n; ++i) {
+	    int qx, unused;
+	    const int x = runs[r][0] + i;
+	    if (!symmetry.map_pixel(e, x, y, qx, unused) || (qx == x && qy == y)) {
+	      continue;
+	    }
+	    const unsigned char c[3] = {mirror_rgb[i], mirror_rgb[i + TILE_SIZE],
+					mirror_rgb[i + 2 * TILE_SIZE]};
+	    put_pixel(*imgs[f], qx, qy - row0, c);
+	  }
+	}
+      }
+    }
+    if (p.packed) {
+      for (int r = 0; r < nruns; ++r) {
+	p.pack_row(y, runs[r][0], spans[r]);
+      }
+    }
+    if (!symmetry.empty()) {
+      for (int r = 0; r < nruns; ++r) {
+	for (int x = runs[r][0]; x < runs[r][1]; ++x) {
+	  mirror_particle(p, x, y);
+	}
+      }
     }
   }
 }
 
-CImg<unsigned char> *render_frame(Point **p, CImg<unsigned char> *img, int steps) {
-  for (int y = 0; y < height; ++y) {
+// Receives rows [y0, y1) of frame f of a banded render, which are rows 0
+// to y1 - y0 of the frame's image. Returns false to stop.
+typedef std::function<bool(int f, int y0, int y1)> Band_Fn;
+
+// Colors the pixels of rows [y0, y1) of the band that starts at row0 whose
+// source pixel lies above the band. Their source's band could not reach
+// them, so they are colored from the state mirror_particle() handed them.
+void color_mirrored_rows(const Particles &p, CImg<unsigned char> &img, int row0, int y0, int y1) {
+  const size_t plane = (size_t)img.width() * img.height();
+  for (int y = y0; y < y1; ++y) {
     for (int x = 0; x < width; ++x) {
-      for (int i = 0; i < steps; ++i) {
-	p[y][x].update();
+      int sx = x, sy = y;
+      for (const Symmetry::Element &e : symmetry.elements) {
+	int qx, qy;
+	if (symmetry.map_pixel(e, x, y, qx, qy) && (qy < sy || (qy == sy && qx < sx))) {
+	  sx = qx;
+	  sy = qy;
+	}
+      }
+      if (sy < row0) {
+	float px, py;
+	p.position(x, y, px, py);
+	weighted_closest(px, py, sim, img.data(x, y - row0), plane);
       }
-      calc_weighted_closest(&(p[y][x]));
-      // if (x == 0 && y == 0) {
-      // 	printf("color: %d %d %d\n", color[0], color[1], color[2]);
-      // }
-      img->draw_point(x,y,0,color);
     }
   }
+}
+
+// step0 is the number of steps the particles have been integrated so far.
+//
+// Out of core, or with band_done, the frame is rendered one band of tiles
+// at a time. Out of core a band is dropped from memory once done with, so
+// its pages are read in and written back once per call, in order. With
+// band_done imgs only hold one band of rows, which band_done takes once
+// they are rendered. That needs nframes = 1, so the mirror images colored
+// from their state are those of this frame. Returns false if band_done did.
+bool render_frames(ThreadPool &pool, Particles &p, CImg<unsigned char> *const *imgs, int nframes,
+		   int lead_steps, int steps, long long step0, const Band_Fn &band_done = nullptr) {
+  int tiles_x = (width + TILE_SIZE - 1) / TILE_SIZE;
+  int tiles_y = (height + TILE_SIZE - 1) / TILE_SIZE;
+  if (!p.file && !band_done) {
+    pool.run(tiles_x * tiles_y, [&](int tile) {
+      render_tile(p, imgs, 0, nframes, lead_steps, steps, step0, tile);
+    });
+    return true;
+  }
+  for (int band = 0; band < tiles_y; ++band) {
+    int y0 = band * TILE_SIZE;
+    int y1 = std::min(y0 + TILE_SIZE, height);
+    int row0 = band_done ? y0 : 0;
+    pool.run(tiles_x, [&](int tile) {
+      render_tile(p, imgs, row0, nframes, lead_steps, steps, step0, band * tiles_x + tile);
+    });
+    if (band_done) {
+      if (!symmetry.empty()) {
+	pool.run(y1 - y0, [&](int y) { color_mirrored_rows(p, *imgs[0], y0, y0 + y, y0 + y + 1); });
+      }
+      for (int f = 0; f < nframes; ++f) {
+	if (!band_done(f, y0, y1)) {
+	  return false;
+	}
+      }
+    } else {
+      for (int f = 0; f < nframes; ++f) {
+	for (int c = 0; c < 3; ++c) {
+	  p.file->release(imgs[f]->data(0, y0, 0, c), (size_t)(y1 - y0) * width);
+	}
+      }
+    }
+    p.release_rows(y0, y1);
+  }
+  return true;
+}
+
+CImg<unsigned char> *render_frame(ThreadPool &pool, Particles &p, CImg<unsigned char> *img, int steps,
+				  long long step0 = 0) {
+  render_frames(pool, p, &img, 1, 0, steps, step0);
   return img;
 }
 
+// n with its digits grouped in threes, as in 1,234,567
+std::string thousands(size_t n) {
+  std::string s = std::to_string(n);
+  for (int i = (int)s.length() - 3; i > 0; i -= 3) {
+    s.insert(i, ",");
+  }
+  return s;
+}
+
+bool has_extension(const std::string &name, const char *ext) {
+  size_t n = strlen(ext);
+  return name.size() >= n && strcasecmp(name.c_str() + name.size() - n, ext) == 0;
+}
+
+// Opens frame `number` for writing, with the same file numbering as
+// CImg::save(). Null if that fails.
+std::unique_ptr<Png_Writer> open_png(const char *savename, int number, int digits, int compression,
+				     std::string &name) {
+  char numbered[1024];
+  cimg::number_filename(savename, number, digits, numbered);
+  name = numbered;
+  std::unique_ptr<Png_Writer> png(new Png_Writer(numbered, width, height, compression));
+  if (!png->ok()) {
+    printf("Error: could not open `%s` for writing\n", numbered);
+    return nullptr;
+  }
+  return png;
+}
+
+// Writes the first n rows of img
+void write_png_rows(Png_Writer &png, const CImg<unsigned char> &img, int n) {
+  const size_t plane = (size_t)img.width() * img.height();
+  std::vector<unsigned char> row(3 * img.width());
+  for (int y = 0; y < n; ++y) {
+    const unsigned char *r = img.data(0, y, 0, 0);
+    for (int x = 0; x < img.width(); ++x) {
+      row[3 * x] = r[x];
+      row[3 * x + 1] = r[x + plane];
+      row[3 * x + 2] = r[x + 2 * plane];
+    }
+    png.write_row(row.data());
+  }
+}
+
+// Saves with the same file numbering as CImg::save(). PNGs go through the
+// built in encoder: without libpng CImg would hand them to an external
+// ImageMagick process, once per frame.
+bool save_frame(const CImg<unsigned char> &img, const char *savename, int number, int digits,
+		int compression) {
+  if (!has_extension(savename, ".png")) {
+    img.save(savename, number, digits);
+    return true;
+  }
+  std::string name;
+  std::unique_ptr<Png_Writer> png = open_png(savename, number, digits, compression, name);
+  if (!png) {
+    return false;
+  }
+  write_png_rows(*png, img, img.height());
+  if (!png->finish()) {
+    printf("Error: failed writing `%s`\n", name.c_str());
+    return false;
+  }
+  return true;
+}
+
+// Writes where every pixel's point is after the frame (-positions) to
+// savename's position file for number, so recolor can color it again
+bool save_positions(Particles &p, const char *savename, int number, int digits,
+		    long long steps) {
+  std::string base = savename;
+  size_t dot = base.rfind('.');
+  if (dot != std::string::npos && (base.rfind('/') == std::string::npos || dot > base.rfind('/'))) {
+    base.erase(dot);
+  }
+  char numbered[1024];
+  cimg::number_filename((base + ".gsp").c_str(), number, digits, numbered);
+  FILE *f = fopen(numbered, "wb");
+  if (!f) {
+    printf("Error: could not open `%s` for writing\n", numbered);
+    return false;
+  }
+  Positions_Header h;
+  h.width = width;
+  h.height = height;
+  h.steps = steps;
+  h.flags = p.captured ? POSITIONS_CAPTURES : 0;
+  h.mx = mass_x;
+  h.my = mass_y;
+  bool ok = h.write(f);
+  Positions_Row row(h);
+  for (int y = 0; ok && y < height; ++y) {
+    for (int x = 0; x < width; ++x) {
+      p.position(x, y, row.x[x], row.y[x]);
+      if (p.captured) {
+	row.captured[x] = p.captured[p.index(x, y)];
+	row.capture_step[x] = p.capture_step[p.index(x, y)];
+      }
+    }
+    ok = row.write(f);
+    if (p.file) {
+      p.release_rows(y, y + 1);
+    }
+  }
+  ok = fclose(f) == 0 && ok;
+  if (!ok) {
+    printf("Error: failed writing `%s`\n", numbered);
+  }
+  return ok;
+}
+
+// The kernel for the integrator and whichever force evaluator is active
+Span_Kernel select_kernel(Simd_Level simd, Integrator integrator) {
+  if (precision != PRECISION_FLOAT) {
+    return wide_span_kernel(precision, sim.nmasses, integrator);
+  } else if (integrator == INTEGRATOR_DOPRI) {
+    return dopri_span_kernel(sim);
+  } else if (sim.field) {
+    return field_span_kernel(integrator);
+  } else if (sim.tree) {
+    return tree_span_kernel(simd, integrator);
+  }
+  return span_kernel(simd, sim.nmasses, integrator);
+}
+
+// Energy per unit mass of a particle under the direct sum: the potential of
+// the pull g * d / (d^2 + s) is g / 2 * ln(d^2 + s) per mass
+double particle_energy(float x, float y, float xv, float yv) {
+  double e = .5 * ((double)xv * xv + (double)yv * yv);
+  for (int m = 0; m < sim.nmasses; ++m) {
+    double dx = sim.mx[m] - x, dy = sim.my[m] - y;
+    e += .5 * sim.gravity * log(dx * dx + dy * dy + sim.softening);
+  }
+  return e;
+}
+
+// Single threaded throughput of every kernel this CPU can run, on a few rows
+// of particles spread over the frame. Also checks that they all agree.
+void run_benchmark(int steps) {
+  const int rows = 8;
+  Particles ref(width, rows);
+  ref.reset();
+  for (int r = 0; r < rows; ++r) {
+    for (int x = 0; x < width; ++x) {
+      ref.y[ref.index(x, r)] = (r + 0.5f) * height / rows;
+    }
+  }
+  printf("Integrating %d particles for %d steps with %zu masses\n",
+	 width * rows, steps, masses.size());
+
+  auto restore = [&](Particles &dst) {
+    memcpy(dst.x, ref.x, ref.bytes_per_array());
+    memcpy(dst.y, ref.y, ref.bytes_per_array());
+    memcpy(dst.xv, ref.xv, ref.bytes_per_array());
+    memcpy(dst.yv, ref.yv, ref.bytes_per_array());
+    memcpy(dst.xa, ref.xa, ref.bytes_per_array());
+    memcpy(dst.ya, ref.ya, ref.bytes_per_array());
+  };
+  auto time_kernel = [&](Particles &dst, Span_Kernel kernel, const Sim_Params &sp) {
+    auto start = std::chrono::steady_clock::now();
+    for (int r = 0; r < rows; ++r) {
+      kernel(dst.row(r, 0, width), steps, sp);
+    }
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return (double)width * rows * steps / secs;
+  };
+
+  Particles p(width, rows);
+  Particles first(width, rows);
+  double base = 0;
+  double direct = 0;
+  // Every level runs once unrolled for the mass count and once generic
+  for (int run = 0; run <= 2 * detect_simd() + 1; ++run) {
+    int l = run / 2;
+    bool generic = run % 2 == 1;
+    if (!generic && sim.nmasses > MAX_UNROLLED_MASSES) {
+      continue;
+    }
+    Span_Kernel kernel = span_kernel((Simd_Level)l, generic ? 0 : sim.nmasses);
+    restore(p);
+
+    double rate = time_kernel(p, kernel, sim);
+    direct = rate;
+    if (base == 0) {
+      base = rate;
+      memcpy(first.x, p.x, p.bytes_per_array());
+      memcpy(first.y, p.y, p.bytes_per_array());
+    }
+    bool same = memcmp(first.x, p.x, p.bytes_per_array()) == 0 &&
+      memcmp(first.y, p.y, p.bytes_per_array()) == 0;
+    printf("  %-12s %-8s %10.2f Msteps/s  %5.2fx  %s\n", simd_name((Simd_Level)l),
+	   generic ? "generic" : "unrolled", rate / 1e6, rate / base, same ? "" : "MISMATCH");
+  }
+
+  // The fixed step integrators at this dt. The real paths conserve energy,
+  // so its drift over the run measures each one's error. The
+  // Euler kernel with dt = 0 computes the pull the others start from.
+  Simd_Level best = detect_simd();
+  Sim_Params rest = sim;
+  rest.dt = 0;
+  printf("Integrators (%s) against the energy they should conserve:\n", simd_name(best));
+  const Integrator integrators[] = {INTEGRATOR_EULER, INTEGRATOR_VERLET, INTEGRATOR_YOSHIDA,
+				    INTEGRATOR_PEFRL};
+  for (Integrator integrator : integrators) {
+    restore(p);
+    if (integrator_needs_pull(integrator)) {
+      for (int r = 0; r < rows; ++r) {
+	span_kernel(best, sim.nmasses)(p.row(r, 0, width), 1, rest);
+      }
+    }
+    double rate = time_kernel(p, span_kernel(best, sim.nmasses, integrator), sim);
+    // Pixels passing close to a mass dominate any mean, the median is the
+    // error of a typical pixel
+    std::vector<double> drift;
+    for (int r = 0; r < rows; ++r) {
+      for (int x = 0; x < width; ++x) {
+	size_t i = p.index(x, r);
+	double e = particle_energy(p.x[i], p.y[i], p.xv[i], p.yv[i]) -
+	  particle_energy(ref.x[i], ref.y[i], ref.xv[i], ref.yv[i]);
+	drift.push_back(std::isfinite(e) ? fabs(e) : INFINITY);
+      }
+    }
+    std::nth_element(drift.begin(), drift.begin() + drift.size() / 2, drift.end());
+    printf("  %-12s %10.2f Msteps/s  %5.2fx  energy drift median %.2e\n",
+	   integrator_name(integrator), rate / 1e6, rate / direct, drift[drift.size() / 2]);
+  }
+
+  // The wider number types, all with the Euler integrator
+  printf("Precision (Euler) against float:\n");
+  const Precision precisions[] = {PRECISION_DOUBLE, PRECISION_FIXED};
+  for (Precision pr : precisions) {
+    restore(p);
+    double rate = time_kernel(p, wide_span_kernel(pr, sim.nmasses), sim);
+    printf("  %-12s %10.2f Msteps/s  %5.2fx\n", precision_name(pr), rate / 1e6, rate / direct);
+  }
+
+  // Coloring the points where the last run left them
+  printf("Coloring:\n");
+  const int color_reps = 200;
+  const size_t plane = (size_t)width * rows;
+  std::vector<unsigned char> rgb(3 * plane), first_rgb;
+  double color_base = 0;
+  for (int l = SIMD_SCALAR; l <= best; ++l) {
+    // The interleaved level colors with the scalar kernel
+    if (l == SIMD_INTERLEAVED) {
+      continue;
+    }
+    Color_Kernel kernel = color_kernel((Simd_Level)l);
+    auto start = std::chrono::steady_clock::now();
+    for (int k = 0; k < color_reps; ++k) {
+      for (int r = 0; r < rows; ++r) {
+	Span s = p.row(r, 0, width);
+	kernel(s.x, s.y, width, sim, rgb.data() + (size_t)r * width, plane);
+      }
+    }
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    double rate = color_reps * plane / secs;
+    if (color_base == 0) {
+      color_base = rate;
+      first_rgb = rgb;
+    }
+    printf("  %-12s %10.2f Mpixels/s  %5.2fx  %s\n", simd_name((Simd_Level)l), rate / 1e6,
+	   rate / color_base, rgb == first_rgb ? "" : "MISMATCH");
+  }
+  if (sim.nmasses <= MAX_UNROLLED_MASSES) {
+    return;
+  }
+
+  // The quadtree against the fastest direct sum above. The force error is
+  // measured on the accelerations after one step from rest, before the
+  // particles' paths have had a chance to diverge.
+  Particles exact(width, rows);
+  restore(exact);
+  for (int r = 0; r < rows; ++r) {
+    span_kernel(best, 0)(exact.row(r, 0, width), 1, sim);
+  }
+  printf("Quadtree (%s) against the direct sum:\n", simd_name(best));
+  const float thetas[] = {.25f, .5f, .75f, 1};
+  for (float theta : thetas) {
+    Quadtree tree(sim.mx, sim.my, sim.nmasses, sim.gravity, theta);
+    Sim_Params tp = sim;
+    tp.tree = &tree;
+    Span_Kernel kernel = tree_span_kernel(best);
+    restore(p);
+    for (int r = 0; r < rows; ++r) {
+      kernel(p.row(r, 0, width), 1, tp);
+    }
+    double total = 0, worst = 0;
+    for (int r = 0; r < rows; ++r) {
+      for (int x = 0; x < width; ++x) {
+	size_t i = p.index(x, r);
+	double e = hypot(p.xa[i] - exact.xa[i], p.ya[i] - exact.ya[i]) /
+	  hypot(exact.xa[i], exact.ya[i]);
+	total += e;
+	worst = std::max(worst, e);
+      }
+    }
+    restore(p);
+    double rate = time_kernel(p, kernel, tp);
+    printf("  theta %.2f   %10.2f Msteps/s  %5.2fx  force error mean %.1e max %.1e\n",
+	   theta, rate / 1e6, rate / direct, total / (width * rows), worst);
+  }
+}
+
+// Size of the -field grid, counted against -memory
+size_t field_grid_bytes() {
+  float margin = FIELD_MARGIN * std::max(width, height);
+  return Field_Grid::fixed_bytes(-margin, -margin, width + margin, height + margin, field_spacing);
+}
+
+// Samples the masses' pull at every node of the -field grid with the
+// integration kernel itself: one step of dt = 0 from rest leaves a particle
+// on its node with the acceleration there.
+void build_field_grid(ThreadPool &pool, Span_Kernel kernel, Mapped_File *scratch) {
+  float margin = FIELD_MARGIN * std::max(width, height);
+  field_grid.reset(new Field_Grid(-margin, -margin, width + margin, height + margin,
+				  field_spacing, field_sampling, field_near, gravity, softening,
+				  scratch));
+  Field_Grid &g = *field_grid;
+  Sim_Params sp = sim;
+  sp.dt = 0;
+  pool.run(g.ny, [&](int j) {
+    std::vector<float> state(6 * g.nx, 0);
+    Span s = {&state[0], &state[g.nx], &state[2 * g.nx], &state[3 * g.nx], &state[4 * g.nx],
+	      &state[5 * g.nx], g.nx, nullptr, nullptr};
+    for (int i = 0; i < g.nx; ++i) {
+      s.x[i] = g.node_x(i);
+      s.y[i] = g.node_y(j);
+    }
+    kernel(s, 1, sp);
+    float *node = &g.a[2 * g.index(0, j)];
+    for (int i = 0; i < g.nx; ++i) {
+      node[2 * i] = s.xa[i];
+      node[2 * i + 1] = s.ya[i];
+    }
+  });
+  g.split(sim.mx, sim.my, sim.nmasses);
+  sim.field = field_grid.get();
+}
 
 #define FLAG_IS(flag) (strcmp(flag, argv[i]) == 0)
 #define TAKES_PARAM(flag) if(i+1 >= argc){printf("Error: " flag " flag requires an argument\n");} else {++i;}
@@ -294,7 +1153,64 @@ int main(int argc, char *argv[]) {
   bool directory_set = false;
   std::string filename = "gravity-snapshot.png";
   bool interactive = false;
+  bool headless = cimg_display == 0;
   bool verbose = false;
+  bool bench = false;
+  bool use_symmetry = true;
+  Integrator integrator = INTEGRATOR_EULER;
+  int compression = 6;
+  int writers = 1;
+  int queue = 4;
+  double memory_mb = 0.75 * sysconf(_SC_PHYS_PAGES) * sysconf(_SC_PAGE_SIZE) / 1e6;
+  std::string scratch_dir;
+  const char *stream_path = nullptr;
+  Stream_Format stream_format = STREAM_Y4M;
+  int fps = 30;
+  int batch = 1;
+  int threads = std::max(1, (int)std::thread::hardware_concurrency());
+  Simd_Level simd = detect_simd();
+  std::string checkpoint_path;
+  double checkpoint_interval = 300;
+  bool save_positions_too = false;
+
+  // -resume runs with the options stored in the checkpoint, then the ones
+  // given now. Checkpoints store these options minus -resume and
+  // -checkpoint, so a resumed run keeps saving to the file it resumed from
+  // unless given another.
+  Checkpoint resume;
+  std::string resume_path;
+  bool new_directory = false;
+  for (int i = 1; i < argc; ++i) {
+    if (FLAG_IS("-resume") && i + 1 < argc) {
+      resume_path = argv[++i];
+    } else if (FLAG_IS("-save-in") || FLAG_IS("-g")) {
+      new_directory = true;
+    }
+  }
+  std::vector<char *> all_args(1, argv[0]);
+  if (!resume_path.empty()) {
+    std::string error;
+    if (!resume.read(resume_path, error)) {
+      printf("Error: cannot resume, %s\n", error.c_str());
+      exit(1);
+    }
+    for (std::string &a : resume.args) {
+      all_args.push_back(&a[0]);
+    }
+    checkpoint_path = resume_path;
+  }
+  all_args.insert(all_args.end(), argv + 1, argv + argc);
+  std::vector<std::string> run_args;
+  for (size_t i = 1; i < all_args.size(); ++i) {
+    if (strcmp(all_args[i], "-resume") == 0 || strcmp(all_args[i], "-checkpoint") == 0) {
+      ++i;
+    } else {
+      run_args.push_back(all_args[i]);
+    }
+  }
+  argc = all_args.size();
+  argv = all_args.data();
+
   for (int i = 1; i < argc; i += 1) {
     if (FLAG_IS("-shape-size")) {
       TAKES_PARAM("-shape-size")
@@ -323,6 +1239,69 @@ int main(int argc, char *argv[]) {
     } else if (FLAG_IS("-step")) {
       TAKES_PARAM("-step")
       step = std::stoi(argv[i]);
+    } else if (FLAG_IS("-threads")) {
+      TAKES_PARAM("-threads")
+      threads = std::max(1, std::stoi(argv[i]));
+    } else if (FLAG_IS("-batch")) {
+      TAKES_PARAM("-batch")
+      batch = std::max(1, std::stoi(argv[i]));
+    } else if (FLAG_IS("-capture")) {
+      TAKES_PARAMS("-capture", 2)
+      capture_radius = std::stof(argv[i-1]);
+      capture_checks = std::min(255, std::max(1, std::stoi(argv[i])));
+    } else if (FLAG_IS("-capture-interval")) {
+      TAKES_PARAM("-capture-interval")
+      capture_interval = std::max(1, std::stoi(argv[i]));
+    } else if (FLAG_IS("-far-field")) {
+      TAKES_PARAM("-far-field")
+      far_field_radius = std::max(0.0f, std::stof(argv[i]));
+    } else if (FLAG_IS("-theta")) {
+      TAKES_PARAM("-theta")
+      tree_theta = std::max(0.0f, std::stof(argv[i]));
+    } else if (FLAG_IS("-tree-masses")) {
+      TAKES_PARAM("-tree-masses")
+      tree_masses = std::max(1, std::stoi(argv[i]));
+    } else if (FLAG_IS("-field")) {
+      TAKES_PARAM("-field")
+      use_field = true;
+      if (strcmp(argv[i], "bilinear") == 0) {
+	field_sampling = FIELD_BILINEAR;
+      } else if (strcmp(argv[i], "bicubic") == 0) {
+	field_sampling = FIELD_BICUBIC;
+      } else {
+	printf("Error: unknown field sampling `%s`\n", argv[i]);
+	exit(1);
+      }
+    } else if (FLAG_IS("-field-spacing")) {
+      TAKES_PARAM("-field-spacing")
+      field_spacing = std::max(0.01f, std::stof(argv[i]));
+    } else if (FLAG_IS("-field-near")) {
+      TAKES_PARAM("-field-near")
+      field_near = std::max(0.1f, std::stof(argv[i]));
+    } else if (FLAG_IS("-simd")) {
+      TAKES_PARAM("-simd")
+      Simd_Level supported = detect_simd();
+      if (strcmp(argv[i], "auto") == 0) {
+	simd = supported;
+      } else if (strcmp(argv[i], "scalar") == 0) {
+	simd = SIMD_SCALAR;
+      } else if (strcmp(argv[i], "interleaved") == 0) {
+	simd = SIMD_INTERLEAVED;
+      } else if (strcmp(argv[i], "sse2") == 0) {
+	simd = SIMD_SSE2;
+      } else if (strcmp(argv[i], "avx2") == 0) {
+	simd = SIMD_AVX2;
+      } else if (strcmp(argv[i], "avx512") == 0) {
+	simd = SIMD_AVX512;
+      } else {
+	printf("Error: unknown SIMD level `%s`\n", argv[i]);
+	exit(1);
+      }
+      if (simd > supported) {
+	printf("Error: this CPU does not support %s, the best available is %s\n",
+	       simd_name(simd), simd_name(supported));
+	exit(1);
+      }
     } else if (FLAG_IS("-size")) {
       TAKES_PARAMS("-size", 2)
       width = std::stoi(argv[i-1]);
@@ -344,8 +1323,93 @@ int main(int argc, char *argv[]) {
     } else if (FLAG_IS("-name")) {
       TAKES_PARAM("-name")
       filename = argv[i];
+    } else if (FLAG_IS("-compression")) {
+      TAKES_PARAM("-compression")
+      compression = std::min(9, std::max(0, std::stoi(argv[i])));
+    } else if (FLAG_IS("-writers")) {
+      TAKES_PARAM("-writers")
+      writers = std::max(0, std::stoi(argv[i]));
+    } else if (FLAG_IS("-queue")) {
+      TAKES_PARAM("-queue")
+      queue = std::max(1, std::stoi(argv[i]));
+    } else if (FLAG_IS("-stream")) {
+      TAKES_PARAMS("-stream", 2)
+      if (strcmp(argv[i-1], "y4m") == 0) {
+	stream_format = STREAM_Y4M;
+      } else if (strcmp(argv[i-1], "rgb") == 0) {
+	stream_format = STREAM_RGB;
+      } else {
+	printf("Error: unknown stream format `%s`\n", argv[i-1]);
+	exit(1);
+      }
+      stream_path = argv[i];
+    } else if (FLAG_IS("-fps")) {
+      TAKES_PARAM("-fps")
+      fps = std::max(1, std::stoi(argv[i]));
+    } else if (FLAG_IS("-integrator")) {
+      TAKES_PARAM("-integrator")
+      if (strcmp(argv[i], "euler") == 0) {
+	integrator = INTEGRATOR_EULER;
+      } else if (strcmp(argv[i], "verlet") == 0) {
+	integrator = INTEGRATOR_VERLET;
+      } else if (strcmp(argv[i], "yoshida") == 0) {
+	integrator = INTEGRATOR_YOSHIDA;
+      } else if (strcmp(argv[i], "pefrl") == 0) {
+	integrator = INTEGRATOR_PEFRL;
+      } else if (strcmp(argv[i], "dopri") == 0) {
+	integrator = INTEGRATOR_DOPRI;
+      } else {
+	printf("Error: unknown integrator `%s`\n", argv[i]);
+	exit(1);
+      }
+    } else if (FLAG_IS("-precision")) {
+      TAKES_PARAM("-precision")
+      if (strcmp(argv[i], "float") == 0) {
+	precision = PRECISION_FLOAT;
+      } else if (strcmp(argv[i], "double") == 0) {
+	precision = PRECISION_DOUBLE;
+      } else if (strcmp(argv[i], "fixed") == 0) {
+	precision = PRECISION_FIXED;
+      } else {
+	printf("Error: unknown precision `%s`\n", argv[i]);
+	exit(1);
+      }
+    } else if (FLAG_IS("-memory")) {
+      TAKES_PARAM("-memory")
+      memory_mb = std::max(0.0, std::stod(argv[i]));
+    } else if (FLAG_IS("-scratch")) {
+      TAKES_PARAM("-scratch")
+      scratch_dir = argv[i];
+    } else if (FLAG_IS("-checkpoint")) {
+      TAKES_PARAM("-checkpoint")
+      checkpoint_path = argv[i];
+    } else if (FLAG_IS("-checkpoint-interval")) {
+      TAKES_PARAM("-checkpoint-interval")
+      checkpoint_interval = std::stod(argv[i]);
+    } else if (FLAG_IS("-resume")) {
+      TAKES_PARAM("-resume")
+    } else if (FLAG_IS("-positions")) {
+      save_positions_too = true;
+    } else if (FLAG_IS("-compact")) {
+      compact = true;
+    } else if (FLAG_IS("-softening")) {
+      TAKES_PARAM("-softening")
+      softening = std::max(1e-6f, std::stof(argv[i]));
+    } else if (FLAG_IS("-encounter")) {
+      TAKES_PARAMS("-encounter", 2)
+      encounter_radius = std::max(0.0f, std::stof(argv[i-1]));
+      encounter_steps = std::max(1, std::stoi(argv[i]));
+    } else if (FLAG_IS("-tol")) {
+      TAKES_PARAM("-tol")
+      sim.tolerance = std::max(1e-6f, std::stof(argv[i]));
+    } else if (FLAG_IS("-no-symmetry")) {
+      use_symmetry = false;
+    } else if (FLAG_IS("-headless")) {
+      headless = true;
     } else if (FLAG_IS("-interactive")) {
       interactive = true;
+    } else if (FLAG_IS("-bench")) {
+      bench = true;
     } else if (FLAG_IS("-v")) {
       verbose = true;
     }
@@ -358,9 +1422,74 @@ int main(int argc, char *argv[]) {
       print_help();
     }
   }
-  
+
+
+  // Opened first: streaming to stdout moves all other output to stderr
+  std::unique_ptr<Video_Stream> stream;
+  if (stream_path && !interactive && !bench) {
+    stream.reset(new Video_Stream(stream_path, stream_format, width, height, fps));
+    if (!stream->ok()) {
+      printf("Error: could not open stream `%s`\n", stream_path);
+      exit(1);
+    }
+    // Frames have to reach the stream in order, which one writer guarantees
+    writers = std::min(writers, 1);
+    save = false;
+  }
+
   init_masses(shape);
+  // Random masses would come out differently
+  if (!resume_path.empty()) {
+    if (resume.mx.size() != masses.size()) {
+      printf("Error: cannot resume, `%s` has %d masses instead of %d\n", resume_path.c_str(),
+	     (int)resume.mx.size(), (int)masses.size());
+      exit(1);
+    }
+    for (size_t m = 0; m < masses.size(); ++m) {
+      masses[m] = Mass(resume.mx[m], resume.my[m]);
+    }
+    update_sim_params();
+  }
+  if (sim.far_field && far_field_radius <= mass_spread) {
+    printf("Error: the far field radius has to be larger than %.1f, the distance of the\n"
+	   "       farthest mass from the center\n", mass_spread);
+    exit(1);
+  }
+  // The field kernel only finds the masses within the split radius
+  if (use_field && encounter_radius > field_near) {
+    printf("Error: with -field the encounter radius can be at most the -field-near\n"
+	   "       distance, %.1f\n", field_near);
+    exit(1);
+  }
+  if (precision != PRECISION_FLOAT && (use_field || integrator == INTEGRATOR_DOPRI)) {
+    printf("Error: -precision %s does not work with -field or -integrator dopri\n",
+	   precision_name(precision));
+    exit(1);
+  }
+  if (compact && precision != PRECISION_FLOAT) {
+    printf("Error: -compact does not work with -precision %s\n", precision_name(precision));
+    exit(1);
+  }
+  // Only the last frame of a batch is left in the particles to save
+  if (save_positions_too) {
+    batch = 1;
+  }
+  if (use_symmetry) {
+    symmetry = Symmetry(sim.mx, sim.my, sim.nmasses, width, height);
+  }
+  if (bench) {
+    run_benchmark(iterations > 0 ? iterations : 200);
+    return 0;
+  }
+  if (!headless && !getenv("DISPLAY")) {
+    printf("No X display found, running headless\n");
+    headless = true;
+  }
   if (interactive) {
+    if (headless) {
+      printf("Error: interactive mode needs a display\n");
+      exit(1);
+    }
     interactive_mode();
     return 0;
   }
@@ -379,7 +1508,10 @@ int main(int argc, char *argv[]) {
       exit(1);
     }
   }  
-  if (timestamp_dir && save) {
+  if (!resume_path.empty() && !resume.directory.empty() && !new_directory) {
+    // The resumed run saves where it did before, unless told otherwise
+    directory = resume.directory;
+  } else if (timestamp_dir && save) {
     auto t = std::time(nullptr);
     auto tm = *std::localtime(&t);
 
@@ -398,10 +1530,49 @@ int main(int argc, char *argv[]) {
 	   "Frames: %d\n"
 	   "Base iterations per frame: %d\n"
 	   "Steps per frame: %d\n"
-	   "dt: %f\n",
-	   triangle_height, frames, iterations, step, dt);
+	   "dt: %f\n"
+	   "Threads: %d\n"
+	   "SIMD: %s\n",
+	   triangle_height, frames, iterations, step, dt, threads, simd_name(simd));
+    if (integrator == INTEGRATOR_DOPRI) {
+      printf("Integrator: %s, tolerance %g\n", integrator_name(integrator), sim.tolerance);
+    } else if (integrator != INTEGRATOR_EULER) {
+      printf("Integrator: %s\n", integrator_name(integrator));
+    }
+    if (precision != PRECISION_FLOAT) {
+      printf("Precision: %s\n", precision_name(precision));
+    }
+    for (const Symmetry::Element &e : symmetry.elements) {
+      if (e.flip_x && e.flip_y) {
+	printf("Symmetry: half turn about (%.1f, %.1f)\n", symmetry.axis_x2 / 2.0,
+	       symmetry.axis_y2 / 2.0);
+      } else if (e.flip_x) {
+	printf("Symmetry: mirror at x = %.1f\n", symmetry.axis_x2 / 2.0);
+      } else {
+	printf("Symmetry: mirror at y = %.1f\n", symmetry.axis_y2 / 2.0);
+      }
+    }
+    if (!symmetry.empty()) {
+      printf("Symmetry: integrating %.1f%% of the pixels\n", 100 * symmetry.source_fraction());
+    }
+    if (sim.tree) {
+      printf("Quadtree: %d masses in %d cells, theta %.2f\n", sim.nmasses, sim.tree->size(),
+	     tree_theta);
+    }
+    if (sim.far_field && sim.tree) {
+      printf("Far field: not used, the quadtree already approximates distant masses\n");
+    } else if (sim.far_field) {
+      printf("Far field: beyond %.1f of (%.1f, %.1f), relative force error below %.2g\n",
+	     far_field_radius, sim.far_x, sim.far_y, far_field_error(far_field_radius));
+    }
+    if (encounter_radius > 0 && integrator != INTEGRATOR_DOPRI) {
+      printf("Encounters: %d substeps within %.1f of a mass\n", encounter_steps,
+	     encounter_radius);
+    }
   }
-  if (!save) {
+  if (stream) {
+    printf("Streaming frames to %s\n", stream_path);
+  } else if (!save) {
     printf("Not Saving\n");
   }  
   if (!save && directory_set) {
@@ -409,66 +1580,277 @@ int main(int argc, char *argv[]) {
 	   "         Output will not be saved!\n\033[39m\n");
   }
 
-  init_masses(shape);
-  CImg<unsigned char> visu(width,height,1,3,0);
-  CImgDisplay main_disp(visu,"Gravity Snapshot");
-  visu.fill(0);
-
-  auto s = std::to_string((width * height * sizeof(Point)));
-  int n = s.length() - 3;
-  while (n > 0) {
-    s.insert(n, ",");
-    n -= 3;
+  // The state, the -field grid and the frames go out of core, into a
+  // scratch file, if they take more than -memory. Frames waiting for a
+  // writer thread are copies.
+  const size_t frame_bytes = (size_t)3 * width * height;
+  const size_t state_bytes = Particles::bytes(width, height, compact, capture_radius > 0,
+					      integrator == INTEGRATOR_DOPRI, wide_size(precision)) +
+    (use_field ? field_grid_bytes() : 0);
+  const size_t total_bytes = state_bytes + frame_bytes * (batch + (writers > 0 ? queue : 0));
+  const double budget = memory_mb * 1e6;
+  std::unique_ptr<Mapped_File> scratch;
+  // Frames saved as PNG (or not at all) are then encoded band by band as
+  // they are rendered, without ever holding a whole frame. Other formats
+  // need it, so those frames go into the scratch file with the state.
+  bool band_frames = false;
+  if (total_bytes > budget) {
+    printf("Out of core: %s bytes of state%s and frames exceed -memory %g MB\n",
+	   thousands(total_bytes).c_str(), use_field ? ", field grid" : "", memory_mb);
+    band_frames = !stream && (!save || has_extension(savename, ".png"));
+    if (band_frames) {
+      printf("Out of core: encoding the frames band by band as they are rendered\n");
+      batch = 1;
+      // Mirror images in other bands would be colored from the rounded state
+      auto crosses_rows = [](const Symmetry::Element &e) { return e.flip_y; };
+      if (compact && std::any_of(symmetry.elements.begin(), symmetry.elements.end(),
+				 crosses_rows)) {
+	symmetry.elements.erase(std::remove_if(symmetry.elements.begin(), symmetry.elements.end(),
+					       crosses_rows), symmetry.elements.end());
+	printf("Out of core: with -compact only mirror images in the same row are used\n");
+      }
+    }
+    if (!band_frames || state_bytes > budget) {
+      std::string path = (scratch_dir.empty() ? directory : scratch_dir + "/") + ".gs-state-" +
+	std::to_string(getpid()) + ".tmp";
+      scratch.reset(new Mapped_File(path));
+      if (!scratch->ok()) {
+	printf("Error: could not create the scratch file `%s`\n", path.c_str());
+	exit(1);
+      }
+      printf("Out of core: keeping the state%s%s in the scratch file `%s`\n",
+	     use_field ? (band_frames ? " and the field grid" : ", the field grid") : "",
+	     band_frames ? "" : " and the frames", path.c_str());
+    }
+    if (!headless) {
+      printf("Out of core: no window\n");
+      headless = true;
+    }
+    // The writer threads would copy every frame into memory
+    writers = 0;
+  } else if (verbose) {
+    printf("Memory: %s bytes\n", thousands(total_bytes).c_str());
   }
-  // printf("Total size required: %s bytes\n", s.c_str());
-  
-  int num_digits = (int)(std::floor(std::log10(frames))) + 1;
 
-  const size_t w = width;  // with the power of c++, everything that should be built in  
-  const size_t h = height; // instead gets to be another few lines or a library
-  Point **p = new Point*[h];
-  for(size_t i = 0; i < h; ++i) {
-    p[i] = new Point[w];
+  CImg<unsigned char> visu;
+  std::unique_ptr<CImgDisplay> main_disp;
+  if (!headless) {
+    visu.assign(width,height,1,3,0);
+    main_disp.reset(new CImgDisplay(visu,"Gravity Snapshot"));
   }
 
-  for (int i = 0; i < height; ++i) {
-    for (int j = 0; j < width; ++j) {
-      p[i][j].reset(j, i);
+  Particles p(width, height, compact, scratch.get());
+  if (capture_radius > 0) {
+    p.track_captures();
+  }
+  if (integrator == INTEGRATOR_DOPRI) {
+    p.track_step_size();
+  }
+  if (precision != PRECISION_FLOAT) {
+    p.track_wide(wide_size(precision));
+  }
+  if (!resume_path.empty()) {
+    std::string error;
+    if (!resume.load_particles(p, error)) {
+      printf("Error: cannot resume from `%s`, %s\n", resume_path.c_str(), error.c_str());
+      exit(1);
     }
+    printf("Resuming from frame %lld of `%s`\n", (long long)resume.frame, resume_path.c_str());
+  } else {
+    p.reset();
+    load_wide(p, precision);
   }
-  render_frame(p, &visu, iterations);
 
-  if (frames == 0) {
-    int i = 0;
-    while (true) {
-      if (main_disp.is_closed()) {
-	printf("Window Closed\n");
-	exit(1);
+  // Endless runs are numbered with CImg's default of 6 digits
+  int num_digits = frames > 0 ? (int)(std::floor(std::log10(frames))) + 1 : 6;
+  if (!resume_path.empty() && resume.digits > 0) {
+    num_digits = resume.digits;
+  }
+
+  ThreadPool pool(threads);
+  if (use_field) {
+    auto start = std::chrono::steady_clock::now();
+    build_field_grid(pool, select_kernel(simd, INTEGRATOR_EULER), scratch.get());
+    if (verbose) {
+      double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+      printf("Field: %dx%d nodes %.2f apart, %.1f MB, built in %.2fs, %.1f near masses per cell\n",
+	     field_grid->nx, field_grid->ny, field_spacing, field_grid->bytes() / 1e6, secs,
+	     field_grid->near_per_cell());
+    }
+  }
+  integrate_kernel = select_kernel(simd, integrator);
+  coloring_kernel = color_kernel(simd);
+  if (compact) {
+    if (integrator != INTEGRATOR_DOPRI && integrator != INTEGRATOR_PEFRL) {
+      pull_kernel = select_kernel(simd, INTEGRATOR_EULER);
+    }
+    pull_from_start = integrator_needs_pull(integrator);
+  } else if (integrator_needs_pull(integrator) && resume_path.empty()) {
+    Sim_Params rest = sim;
+    rest.dt = 0;
+    Span_Kernel kernel = select_kernel(simd, INTEGRATOR_EULER);
+    pool.run(height, [&](int y) { kernel(p.row(y, 0, width), 1, rest); });
+  }
+  p.release_rows(0, height);
+  Frame_Writer writer(writers, queue, [&](const CImg<unsigned char> &img, int number) {
+    if (stream) {
+      if (!stream->write_frame(img.data(0, 0, 0, 0), img.data(0, 0, 0, 1), img.data(0, 0, 0, 2))) {
+	printf("Error: writing frame %d to the stream failed\n", number);
+	return false;
       }
-      render_frame(p, &visu, step);
-      visu.display(main_disp);
-      if (save) {
-	visu.save(savename, i);
+      return true;
+    }
+    return save_frame(img, savename, number, num_digits, compression);
+  });
+  std::vector<CImg<unsigned char> > batch_frames;
+  for (int f = 0; f < batch; ++f) {
+    if (band_frames) {
+      batch_frames.emplace_back(width, TILE_SIZE, 1, 3, 0);
+    } else if (scratch) {
+      unsigned char *mem = (unsigned char *)scratch->allocate(frame_bytes);
+      if (!mem) {
+	printf("Error: no space left for the scratch file\n");
+	exit(1);
       }
-      ++i;
+      batch_frames.emplace_back(mem, width, height, 1, 3, true);
+    } else {
+      batch_frames.emplace_back(width, height, 1, 3, 0);
     }
   }
-  
-  for (int i = 0; i < frames; i += 1) {
-    if (main_disp.is_closed()) {
+  std::vector<CImg<unsigned char> *> batch_ptrs;
+  for (auto &img : batch_frames) {
+    batch_ptrs.push_back(&img);
+  }
+
+  // Banded frames go straight into their PNG file, one band of rows at a time
+  std::unique_ptr<Png_Writer> png;
+  std::string png_name;
+  Band_Fn band_done;
+  if (band_frames) {
+    band_done = [&](int, int y0, int y1) {
+      if (png) {
+	write_png_rows(*png, batch_frames[0], y1 - y0);
+      }
+      return true;
+    };
+  }
+
+  // The initial iterations are integrated along with the first batch
+  int lead_steps = resume_path.empty() ? iterations : 0;
+  long long steps_done = resume.steps_done;
+  const int first_frame = resume.frame;
+
+  // Checkpoints are taken between batches, once every frame before them
+  // is written
+  std::unique_ptr<Checkpoint_Writer> checkpointer;
+  Checkpoint state;
+  auto last_checkpoint = std::chrono::steady_clock::now();
+  if (!checkpoint_path.empty()) {
+    checkpointer.reset(new Checkpoint_Writer(checkpoint_path));
+    state.args = run_args;
+    state.digits = num_digits;
+    state.directory = directory;
+    state.mx = mass_x;
+    state.my = mass_y;
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_stop_signal;
+    // A second Ctrl-C stops the run right away
+    sa.sa_flags = SA_RESETHAND | SA_RESTART;
+    sigaction(SIGINT, &sa, nullptr);
+    sigaction(SIGTERM, &sa, nullptr);
+  }
+  auto save_checkpoint = [&](int frame, bool background) {
+    if (!writer.drain()) {
+      writer.finish();
+      exit(1);
+    }
+    state.frame = frame;
+    state.steps_done = steps_done;
+    if (!checkpointer->save(state, p, background)) {
+      writer.finish();
+      exit(1);
+    }
+    last_checkpoint = std::chrono::steady_clock::now();
+  };
+
+  int rendered = 0;
+  for (int i = first_frame; frames == 0 || i < frames; i += rendered) {
+    if (main_disp && main_disp->is_closed()) {
       printf("Window Closed\n");
+      writer.finish();
+      exit(1);
+    }
+    if (checkpointer && i > first_frame) {
+      double since = std::chrono::duration<double>(std::chrono::steady_clock::now() -
+						   last_checkpoint).count();
+      if (stop_signal || since >= checkpoint_interval) {
+	save_checkpoint(i, !stop_signal);
+      }
+    }
+    if (stop_signal) {
+      writer.finish();
+      checkpointer->wait();
+      if (i > first_frame) {
+	printf("Stopped before frame %d, continue with -resume %s\n", i, checkpoint_path.c_str());
+      } else {
+	printf("Stopped\n");
+      }
+      exit(128 + stop_signal);
+    }
+    rendered = frames == 0 ? batch : std::min(batch, frames - i);
+    if (band_frames && save) {
+      png = open_png(savename, i, num_digits, compression, png_name);
+      if (!png) {
+	exit(1);
+      }
+    }
+    render_frames(pool, p, batch_ptrs.data(), rendered, lead_steps, step, steps_done, band_done);
+    steps_done += lead_steps + (long long)rendered * step;
+    lead_steps = 0;
+    if (save_positions_too && !save_positions(p, savename, i, num_digits, steps_done)) {
+      writer.finish();
       exit(1);
     }
-    render_frame(p, &visu, step);
-    visu.display(main_disp);
-    if (save) {
-      visu.save(savename, i, num_digits);
+    if (band_frames) {
+      if (png && !png->finish()) {
+	printf("Error: failed writing `%s`\n", png_name.c_str());
+	exit(1);
+      }
+      continue;
+    }
+    for (int f = 0; f < rendered; ++f) {
+      if (main_disp) {
+	batch_frames[f].display(*main_disp);
+      }
+      if ((save || stream) && !writer.submit(batch_frames[f], i + f)) {
+	writer.finish();
+	exit(1);
+      }
+      if (scratch) {
+	scratch->release(batch_frames[f].data(), frame_bytes);
+      }
     }
   }
+  if (!writer.finish()) {
+    exit(1);
+  }
+  if (checkpointer) {
+    save_checkpoint(frames, false);
+  }
   printf("Frame Rendering Complete\n");
+  if (verbose && p.captured) {
+    long long count = 0;
+    for (int y = 0; y < height; ++y) {
+      for (int x = 0; x < width; ++x) {
+	count += p.captured[p.index(x, y)] >= 0;
+      }
+    }
+    printf("Captured: %.1f%% of pixels\n", 100.0 * count / ((double)width * height));
+  }
 
-  while (!main_disp.is_closed()) {
-    main_disp.wait();
+  while (main_disp && !main_disp->is_closed()) {
+    main_disp->wait();
   }
   return 0;
 }
@@ -0,0 +1,854 @@
+#ifndef GRAVITY_SNAPSHOT_INTEGRATE_H
+#define GRAVITY_SNAPSHOT_INTEGRATE_H
+
+#include "particles.h"
+#include "quadtree.h"
+#include "symplectic.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define GS_X86 1
+#include <immintrin.h>
+#else
+#define GS_X86 0
+#endif
+
+struct Field_Grid;
+
+// Everything the integration kernels need to know about the simulation. The
+// mass positions are kept as two flat arrays so the SIMD kernels can
+// broadcast them straight into registers.
+struct Sim_Params {
+  const float *mx = nullptr;
+  const float *my = nullptr;
+  int nmasses = 0;
+  float gravity = 0;
+  float dt = 0;
+
+  // Far field approximation (-far-field): beyond sqrt(far_r2) from the
+  // masses' center (far_x, far_y) the sum over the masses is replaced by a
+  // single combined mass of strength far_gravity at the center.
+  bool far_field = false;
+  float far_x = 0;
+  float far_y = 0;
+  float far_r2 = 0;
+  float far_gravity = 0;
+
+  // Barnes-Hut tree over the masses, used by the tree kernels in place of
+  // the sum over every mass
+  const Quadtree *tree = nullptr;
+
+  // Precomputed acceleration field (-field), sampled by the field kernel
+  const Field_Grid *field = nullptr;
+
+  // Largest error the adaptive integrator accepts per step, in pixels
+  float tolerance = 1e-3f;
+
+  // Added to the squared distance in every pull (-softening), which keeps
+  // the pull finite at the masses
+  float softening = .1f;
+
+  // Close encounters (-encounter, see step_encounters): within
+  // sqrt(encounter_r2) of a mass a step is taken as encounter_steps substeps
+  float encounter_r2 = 0;
+  int encounter_steps = 1;
+};
+
+// How particles are advanced in time (-integrator). The fixed step ones are
+// policies from symplectic.h that every kernel is templated on, dopri is
+// the adaptive kernel in adaptive.h.
+enum Integrator {
+  INTEGRATOR_EULER,
+  INTEGRATOR_VERLET,
+  INTEGRATOR_YOSHIDA,
+  INTEGRATOR_PEFRL,
+  INTEGRATOR_DOPRI
+};
+
+inline const char *integrator_name(Integrator i) {
+  switch (i) {
+  case INTEGRATOR_VERLET: return "verlet";
+  case INTEGRATOR_YOSHIDA: return "yoshida";
+  case INTEGRATOR_PEFRL: return "pefrl";
+  case INTEGRATOR_DOPRI: return "dopri";
+  default: return "euler";
+  }
+}
+
+// Whether a step starts by kicking with the pull stored by the step before,
+// which particles fresh from rest do not have yet. Euler also uses it, but
+// starts from a zero pull to keep its original output.
+inline bool integrator_needs_pull(Integrator i) {
+  return i == INTEGRATOR_VERLET || i == INTEGRATOR_YOSHIDA;
+}
+
+// The kernels are templated on the number of masses N. For the built in
+// layouts and small random ones the count is a compile time constant, the
+// mass loop is unrolled completely and the mass positions live in registers
+// for the whole span. N == 0 is the generic version that reads the count and
+// positions from Sim_Params, used for large numbers of masses.
+const int MAX_UNROLLED_MASSES = 8;
+
+// The masses' pull on a particle at (x, y). `near` is set to the squared
+// distance of the nearest mass, or infinity in the far field.
+template<int N>
+inline void accelerate(float x, float y, float &xa, float &ya, float &near, const float *mx,
+		       const float *my, const Sim_Params &sp) {
+  const int n = N > 0 ? N : sp.nmasses;
+  if (sp.far_field) {
+    float cx = sp.far_x - x;
+    float cy = sp.far_y - y;
+    float c = (cx * cx) + (cy * cy);
+    if (c > sp.far_r2) {
+      float f = sp.far_gravity / (c + sp.softening);
+      xa = cx * f;
+      ya = cy * f;
+      near = INFINITY;
+      return;
+    }
+  }
+  float xacc = 0;
+  float yacc = 0;
+  float nearest = INFINITY;
+#pragma GCC unroll 16
+  for (int m = 0; m < n; ++m) {
+    float dx = mx[m] - x;
+    float dy = my[m] - y;
+    float d = (dx * dx) + (dy * dy);
+    float f = sp.gravity / (d + sp.softening);
+    xacc += dx * f;
+    yacc += dy * f;
+    nearest = std::min(nearest, d);
+  }
+  xa = xacc;
+  ya = yacc;
+  near = nearest;
+}
+
+template<int N>
+inline void accelerate(float x, float y, float &xa, float &ya, const float *mx, const float *my,
+		       const Sim_Params &sp) {
+  float near;
+  accelerate<N>(x, y, xa, ya, near, mx, my, sp);
+}
+
+// Squared distance from (x, y) to the nearest mass
+inline float nearest_mass(float x, float y, const Sim_Params &sp) {
+  float nearest = INFINITY;
+  for (int m = 0; m < sp.nmasses; ++m) {
+    float dx = sp.mx[m] - x;
+    float dy = sp.my[m] - y;
+    nearest = std::min(nearest, (dx * dx) + (dy * dy));
+  }
+  return nearest;
+}
+
+// Close encounters (-encounter). The pull changes fastest next to a mass,
+// which is where a fixed step goes wrong first, so only there it is split
+// up. Every pull also records `near`, the squared distance of the nearest
+// mass it summed, and a particle that was within sqrt(sp.encounter_r2) of
+// one takes its next step as sp.encounter_steps substeps of the same
+// policy. The group it is in takes the substeps together, but only the
+// close particles keep their outcome: what happens to a particle does not
+// depend on which others share its group, so the kernels still agree.
+//
+// The particle state S of a kernel provides x, y, xv, yv, xa, ya and near
+// (scalars, arrays or vectors) for size() particles, at most 32.
+
+// Element i of a state member, whether it is a scalar, an array or a vector
+inline float &lane(float &v, int) {
+  return v;
+}
+
+inline float &lane(float *v, int i) {
+  return v[i];
+}
+
+template<typename V>
+inline auto lane(V &v, int i) -> decltype(v[i]) {
+  return v[i];
+}
+
+// Sets near for a state that has not been pulled yet
+template<typename S>
+inline void find_near(S &s) {
+  for (int i = 0; i < s.size(); ++i) {
+    lane(s.near, i) = s.sp.encounter_r2 > 0
+      ? nearest_mass((float)lane(s.x, i), (float)lane(s.y, i), s.sp) : INFINITY;
+  }
+}
+
+// S with its drifts and kicks scaled by f, for taking substeps
+template<typename S>
+struct Scaled_State {
+  S &s;
+  float f;
+
+  __attribute__((always_inline)) void drift(float c) {
+    s.drift(c * f);
+  }
+
+  __attribute__((always_inline)) void kick(float c) {
+    s.kick(c * f);
+  }
+
+  __attribute__((always_inline)) void pull() {
+    s.pull();
+  }
+};
+
+// One step of policy P for every particle of s
+template<typename P, typename S>
+__attribute__((always_inline)) inline void step_encounters(S &s) {
+  const Sim_Params &sp = s.sp;
+  unsigned close = 0;
+  if (sp.encounter_r2 > 0) {
+    for (int i = 0; i < s.size(); ++i) {
+      close |= (unsigned)(lane(s.near, i) < sp.encounter_r2) << i;
+    }
+  }
+  if (!close) {
+    P::step(s);
+    return;
+  }
+  S normal = s;
+  P::step(normal);
+  Scaled_State<S> sub = {s, 1.0f / sp.encounter_steps};
+  for (int k = 0; k < sp.encounter_steps; ++k) {
+    P::step(sub);
+  }
+  for (int i = 0; i < s.size(); ++i) {
+    if (close & (1u << i)) {
+      continue;
+    }
+    lane(s.x, i) = lane(normal.x, i);
+    lane(s.y, i) = lane(normal.y, i);
+    lane(s.xv, i) = lane(normal.xv, i);
+    lane(s.yv, i) = lane(normal.yv, i);
+    lane(s.xa, i) = lane(normal.xa, i);
+    lane(s.ya, i) = lane(normal.ya, i);
+    lane(s.near, i) = lane(normal.near, i);
+  }
+}
+
+// One time step for a single particle. Every kernel below performs exactly
+// these operations in exactly this order, in single precision and without
+// fused multiply-adds, so all of them produce bit-identical trajectories.
+// That relies on building with -ffp-contract=off (see the makefile): GCC
+// otherwise fuses the multiplies and adds in the AVX-512 kernel.
+//
+// The operations themselves come from the integrator policy P (see
+// symplectic.h); Particle_State is the state it works on.
+template<int N>
+struct Particle_State {
+  float x, y, xv, yv, xa, ya, near;
+  const float *mx;
+  const float *my;
+  const Sim_Params &sp;
+
+  int size() const {
+    return 1;
+  }
+
+  __attribute__((always_inline)) void drift(float c) {
+    const float h = c * sp.dt;
+    x += xv * h;
+    y += yv * h;
+  }
+
+  __attribute__((always_inline)) void kick(float c) {
+    const float h = c * sp.dt;
+    xv += xa * h;
+    yv += ya * h;
+  }
+
+  __attribute__((always_inline)) void pull() {
+    accelerate<N>(x, y, xa, ya, near, mx, my, sp);
+  }
+};
+
+template<int N, typename P = Euler_Step>
+inline void integrate(float &x, float &y, float &xv, float &yv, float &xa, float &ya,
+		      const float *mx, const float *my, const Sim_Params &sp) {
+  Particle_State<N> st = {x, y, xv, yv, xa, ya, INFINITY, mx, my, sp};
+  P::step(st);
+  x = st.x;
+  y = st.y;
+  xv = st.xv;
+  yv = st.yv;
+  xa = st.xa;
+  ya = st.ya;
+}
+
+inline void integrate(float &x, float &y, float &xv, float &yv, float &xa, float &ya,
+		      const Sim_Params &sp) {
+  integrate<0>(x, y, xv, yv, xa, ya, sp.mx, sp.my, sp);
+}
+
+// Advance particles [begin, s.n) of the span by `steps` time steps
+template<int N, typename P>
+inline void integrate_span_scalar(const Span &s, int steps, const Sim_Params &sp, int begin = 0) {
+  float mx[N > 0 ? N : 1], my[N > 0 ? N : 1];
+  for (int m = 0; m < N; ++m) {
+    mx[m] = sp.mx[m];
+    my[m] = sp.my[m];
+  }
+  const float *pmx = N > 0 ? mx : sp.mx;
+  const float *pmy = N > 0 ? my : sp.my;
+
+  for (int i = begin; i < s.n; ++i) {
+    Particle_State<N> st = {s.x[i], s.y[i], s.xv[i], s.yv[i], s.xa[i], s.ya[i], 0, pmx, pmy,
+			    sp};
+    find_near(st);
+    for (int j = 0; j < steps; ++j) {
+      step_encounters<P>(st);
+    }
+    s.x[i] = st.x;
+    s.y[i] = st.y;
+    s.xv[i] = st.xv;
+    s.yv[i] = st.yv;
+    s.xa[i] = st.xa;
+    s.ya[i] = st.ya;
+  }
+}
+
+// Advances INTERLEAVE particles in lockstep. A single particle is one long
+// dependency chain (every step waits on the divide of the step before), so
+// the scalar kernel is bound by divide latency; keeping several independent
+// chains in flight lets them overlap even without vector instructions.
+const int INTERLEAVE = 8;
+
+template<int N>
+struct Interleaved_State {
+  static const int G = INTERLEAVE;
+  float x[G], y[G], xv[G], yv[G], xa[G], ya[G], near[G];
+  const float *mx;
+  const float *my;
+  const Sim_Params &sp;
+
+  Interleaved_State(const float *pmx, const float *pmy, const Sim_Params &params)
+    : mx(pmx), my(pmy), sp(params) {}
+
+  int size() const {
+    return G;
+  }
+
+  __attribute__((always_inline)) void drift(float c) {
+    const float h = c * sp.dt;
+    for (int g = 0; g < G; ++g) {
+      x[g] += xv[g] * h;
+      y[g] += yv[g] * h;
+    }
+  }
+
+  __attribute__((always_inline)) void kick(float c) {
+    const float h = c * sp.dt;
+    for (int g = 0; g < G; ++g) {
+      xv[g] += xa[g] * h;
+      yv[g] += ya[g] * h;
+    }
+  }
+
+  __attribute__((always_inline)) void pull() {
+    const int n = N > 0 ? N : sp.nmasses;
+    float xacc[G], yacc[G], nearest[G];
+    for (int g = 0; g < G; ++g) {
+      xacc[g] = 0;
+      yacc[g] = 0;
+      nearest[g] = INFINITY;
+    }
+    // Particles in the far field take the combined mass's pull instead
+    bool far[G] = {false};
+    float far_xa[G], far_ya[G];
+    int nfar = 0;
+    if (sp.far_field) {
+      for (int g = 0; g < G; ++g) {
+	float cx = sp.far_x - x[g];
+	float cy = sp.far_y - y[g];
+	float c = (cx * cx) + (cy * cy);
+	float f = sp.far_gravity / (c + sp.softening);
+	far[g] = c > sp.far_r2;
+	far_xa[g] = cx * f;
+	far_ya[g] = cy * f;
+	nfar += far[g];
+      }
+    }
+    if (nfar < G) {
+#pragma GCC unroll 16
+      for (int m = 0; m < n; ++m) {
+	const float mxm = mx[m], mym = my[m];
+	for (int g = 0; g < G; ++g) {
+	  float dx = mxm - x[g];
+	  float dy = mym - y[g];
+	  float d = (dx * dx) + (dy * dy);
+	  float f = sp.gravity / (d + sp.softening);
+	  xacc[g] += dx * f;
+	  yacc[g] += dy * f;
+	  nearest[g] = std::min(nearest[g], d);
+	}
+      }
+    }
+    for (int g = 0; g < G; ++g) {
+      xa[g] = far[g] ? far_xa[g] : xacc[g];
+      ya[g] = far[g] ? far_ya[g] : yacc[g];
+      near[g] = far[g] ? INFINITY : nearest[g];
+    }
+  }
+};
+
+template<int N, typename P>
+inline void integrate_span_interleaved(const Span &s, int steps, const Sim_Params &sp) {
+  const int G = INTERLEAVE;
+  float mx[N > 0 ? N : 1], my[N > 0 ? N : 1];
+  for (int m = 0; m < N; ++m) {
+    mx[m] = sp.mx[m];
+    my[m] = sp.my[m];
+  }
+  const float *pmx = N > 0 ? mx : sp.mx;
+  const float *pmy = N > 0 ? my : sp.my;
+
+  int i = 0;
+  for (; i + G <= s.n; i += G) {
+    Interleaved_State<N> st(pmx, pmy, sp);
+    for (int g = 0; g < G; ++g) {
+      st.x[g] = s.x[i + g];
+      st.y[g] = s.y[i + g];
+      st.xv[g] = s.xv[i + g];
+      st.yv[g] = s.yv[i + g];
+      st.xa[g] = s.xa[i + g];
+      st.ya[g] = s.ya[i + g];
+    }
+    find_near(st);
+    for (int j = 0; j < steps; ++j) {
+      step_encounters<P>(st);
+    }
+    for (int g = 0; g < G; ++g) {
+      s.x[i + g] = st.x[g];
+      s.y[i + g] = st.y[g];
+      s.xv[i + g] = st.xv[g];
+      s.yv[i + g] = st.yv[g];
+      s.xa[i + g] = st.xa[g];
+      s.ya[i + g] = st.ya[g];
+    }
+  }
+  integrate_span_scalar<N, P>(s, steps, sp, i);
+}
+
+#if GS_X86
+
+// The vector kernels share one body written with GCC vector extensions and
+// templated on the vector type V. It is always inlined into a thin wrapper
+// per instruction set whose target attribute decides which instructions the
+// body is compiled to. Each batch of lane-width particles goes through all
+// of its steps at once; whatever does not fill a whole batch at the end of
+// the span is handed to the scalar kernel.
+typedef float v4sf __attribute__((vector_size(16)));
+typedef float v8sf __attribute__((vector_size(32)));
+typedef float v16sf __attribute__((vector_size(64)));
+
+template<typename V, int N>
+struct Vector_State {
+  V x, y, xv, yv, xa, ya, near;
+  const V *mx; // broadcast mass positions, only for N > 0
+  const V *my;
+  const Sim_Params &sp;
+
+  int size() const {
+    return sizeof(V) / sizeof(float);
+  }
+
+  __attribute__((always_inline)) void drift(float c) {
+    const float h = c * sp.dt;
+    x += xv * h;
+    y += yv * h;
+  }
+
+  __attribute__((always_inline)) void kick(float c) {
+    const float h = c * sp.dt;
+    xv += xa * h;
+    yv += ya * h;
+  }
+
+  __attribute__((always_inline)) void pull() {
+    const int W = sizeof(V) / sizeof(float);
+    const int n = N > 0 ? N : sp.nmasses;
+    // Lanes in the far field take the combined mass's pull instead. The
+    // exact sum is skipped only when every lane is far away.
+    decltype(x > x) far = {};
+    V far_xa = {}, far_ya = {};
+    bool all_far = false, any_far = false;
+    if (sp.far_field) {
+      V cx = sp.far_x - x;
+      V cy = sp.far_y - y;
+      V c = (cx * cx) + (cy * cy);
+      V f = sp.far_gravity / (c + sp.softening);
+      far = c > sp.far_r2;
+      far_xa = cx * f;
+      far_ya = cy * f;
+      all_far = true;
+      for (int l = 0; l < W; ++l) {
+	all_far = all_far && far[l];
+	any_far = any_far || far[l];
+      }
+    }
+    const V infinity = INFINITY - V{};
+    if (all_far) {
+      xa = far_xa;
+      ya = far_ya;
+      near = infinity;
+      return;
+    }
+    V xacc = {};
+    V yacc = {};
+    V nearest = infinity;
+#pragma GCC unroll 16
+    for (int m = 0; m < n; ++m) {
+      V dx = (N > 0 ? mx[m] : sp.mx[m] - V{}) - x;
+      V dy = (N > 0 ? my[m] : sp.my[m] - V{}) - y;
+      V d = (dx * dx) + (dy * dy);
+      V f = sp.gravity / (d + sp.softening);
+      xacc += dx * f;
+      yacc += dy * f;
+      nearest = d < nearest ? d : nearest;
+    }
+    xa = any_far ? (far ? far_xa : xacc) : xacc;
+    ya = any_far ? (far ? far_ya : yacc) : yacc;
+    near = any_far ? (far ? infinity : nearest) : nearest;
+  }
+};
+
+template<typename V, int N, typename P>
+__attribute__((always_inline))
+inline void integrate_span_vector(const Span &s, int steps, const Sim_Params &sp) {
+  const int W = sizeof(V) / sizeof(float);
+  V mx[N > 0 ? N : 1], my[N > 0 ? N : 1];
+#pragma GCC unroll 16
+  for (int m = 0; m < N; ++m) {
+    mx[m] = sp.mx[m] - V{};
+    my[m] = sp.my[m] - V{};
+  }
+
+  int i = 0;
+  for (; i + W <= s.n; i += W) {
+    Vector_State<V, N> st = {V{}, V{}, V{}, V{}, V{}, V{}, V{}, mx, my, sp};
+    memcpy(&st.x, s.x + i, sizeof(V));
+    memcpy(&st.y, s.y + i, sizeof(V));
+    memcpy(&st.xv, s.xv + i, sizeof(V));
+    memcpy(&st.yv, s.yv + i, sizeof(V));
+    memcpy(&st.xa, s.xa + i, sizeof(V));
+    memcpy(&st.ya, s.ya + i, sizeof(V));
+    find_near(st);
+    for (int j = 0; j < steps; ++j) {
+      step_encounters<P>(st);
+    }
+    memcpy(s.x + i, &st.x, sizeof(V));
+    memcpy(s.y + i, &st.y, sizeof(V));
+    memcpy(s.xv + i, &st.xv, sizeof(V));
+    memcpy(s.yv + i, &st.yv, sizeof(V));
+    memcpy(s.xa + i, &st.xa, sizeof(V));
+    memcpy(s.ya + i, &st.ya, sizeof(V));
+  }
+  integrate_span_scalar<N, P>(s, steps, sp, i);
+}
+
+template<int N, typename P>
+__attribute__((target("sse2")))
+void integrate_span_sse2(const Span &s, int steps, const Sim_Params &sp) {
+  integrate_span_vector<v4sf, N, P>(s, steps, sp);
+}
+
+template<int N, typename P>
+__attribute__((target("avx2")))
+void integrate_span_avx2(const Span &s, int steps, const Sim_Params &sp) {
+  integrate_span_vector<v8sf, N, P>(s, steps, sp);
+}
+
+template<int N, typename P>
+__attribute__((target("avx512f")))
+void integrate_span_avx512(const Span &s, int steps, const Sim_Params &sp) {
+  integrate_span_vector<v16sf, N, P>(s, steps, sp);
+}
+
+#endif
+
+enum Simd_Level {
+  SIMD_SCALAR,
+  SIMD_INTERLEAVED,
+  SIMD_SSE2,
+  SIMD_AVX2,
+  SIMD_AVX512
+};
+
+inline const char *simd_name(Simd_Level l) {
+  switch (l) {
+  case SIMD_INTERLEAVED: return "interleaved";
+  case SIMD_SSE2: return "sse2";
+  case SIMD_AVX2: return "avx2";
+  case SIMD_AVX512: return "avx512";
+  default: return "scalar";
+  }
+}
+
+// Widest instruction set both the CPU and the OS support
+inline Simd_Level detect_simd() {
+#if GS_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f")) {
+    return SIMD_AVX512;
+  } else if (__builtin_cpu_supports("avx2")) {
+    return SIMD_AVX2;
+  } else if (__builtin_cpu_supports("sse2")) {
+    return SIMD_SSE2;
+  }
+#endif
+  return SIMD_INTERLEAVED;
+}
+
+typedef void (*Span_Kernel)(const Span &s, int steps, const Sim_Params &sp);
+
+template<int N, typename P>
+void integrate_span_scalar_kernel(const Span &s, int steps, const Sim_Params &sp) {
+  integrate_span_scalar<N, P>(s, steps, sp);
+}
+
+// Instantiation of `kernel` for nmasses, or the generic one if there are too
+// many masses to unroll
+#define GS_MASS_DISPATCH(kernel, nmasses)	\
+  switch (nmasses) {				\
+  case 1: return kernel<1>;			\
+  case 2: return kernel<2>;			\
+  case 3: return kernel<3>;			\
+  case 4: return kernel<4>;			\
+  case 5: return kernel<5>;			\
+  case 6: return kernel<6>;			\
+  case 7: return kernel<7>;			\
+  case 8: return kernel<8>;			\
+  default: return kernel<0>;			\
+  }
+
+// The same for kernels templated on an integrator policy P as well
+#define GS_MASS_POLICY_DISPATCH(kernel, nmasses, P)	\
+  switch (nmasses) {					\
+  case 1: return kernel<1, P>;				\
+  case 2: return kernel<2, P>;				\
+  case 3: return kernel<3, P>;				\
+  case 4: return kernel<4, P>;				\
+  case 5: return kernel<5, P>;				\
+  case 6: return kernel<6, P>;				\
+  case 7: return kernel<7, P>;				\
+  case 8: return kernel<8, P>;				\
+  default: return kernel<0, P>;				\
+  }
+
+// Calls fn<Policy>(args) for a fixed step integrator
+#define GS_POLICY_DISPATCH(fn, integrator, args)		\
+  switch (integrator) {						\
+  case INTEGRATOR_VERLET: return fn<Verlet_Step> args;		\
+  case INTEGRATOR_YOSHIDA: return fn<Yoshida_Step> args;	\
+  case INTEGRATOR_PEFRL: return fn<Pefrl_Step> args;		\
+  default: return fn<Euler_Step> args;				\
+  }
+
+template<typename P>
+inline Span_Kernel span_kernel(Simd_Level l, int nmasses) {
+  switch (l) {
+  case SIMD_INTERLEAVED: GS_MASS_POLICY_DISPATCH(integrate_span_interleaved, nmasses, P)
+#if GS_X86
+  case SIMD_SSE2: GS_MASS_POLICY_DISPATCH(integrate_span_sse2, nmasses, P)
+  case SIMD_AVX2: GS_MASS_POLICY_DISPATCH(integrate_span_avx2, nmasses, P)
+  case SIMD_AVX512: GS_MASS_POLICY_DISPATCH(integrate_span_avx512, nmasses, P)
+#endif
+  default: GS_MASS_POLICY_DISPATCH(integrate_span_scalar_kernel, nmasses, P)
+  }
+}
+
+inline Span_Kernel span_kernel(Simd_Level l, int nmasses, Integrator i = INTEGRATOR_EULER) {
+  GS_POLICY_DISPATCH(span_kernel, i, (l, nmasses))
+}
+
+// The tree kernels integrate particles in groups of TREE_GROUP that share
+// one interaction list from the quadtree. A list is built for a box around
+// the group that depends only on where its particles are (see tree_box), and
+// reused for as long as that box stays the same. So the lists, and with them
+// the pull, do not depend on how the steps are split into kernel calls. The
+// group size is the same for every instruction set, so they all build the
+// same lists and agree exactly.
+const int TREE_GROUP = 16;
+
+// The box whose interaction list pulls on particles within [x0, x1] x
+// [y0, y1]: cells of the power of two c just above the larger extent, on a
+// grid c / 2 apart, 1.5 c across, which always holds the particles. The
+// divisions are by powers of two and exact.
+inline void tree_box(float x0, float y0, float x1, float y1, float &bx0, float &by0, float &bx1,
+		     float &by1) {
+  int e;
+  frexpf(std::max(1.0f, std::max(x1 - x0, y1 - y0)), &e);
+  const float half = ldexpf(1, e - 1);
+  bx0 = floorf(x0 / half) * half;
+  by0 = floorf(y0 / half) * half;
+  bx1 = bx0 + 3 * half;
+  by1 = by0 + 3 * half;
+}
+
+// State of one group for the integrator policy. Every pull checks the box
+// of the group against the one its list was built for. The list keeps that
+// box itself, so copies of a group that share it (see step_encounters)
+// never use a list built for another box.
+template<typename V>
+struct Tree_Group {
+  static const int W = sizeof(V) / sizeof(float);
+  static const int NV = TREE_GROUP / W;
+  float x[TREE_GROUP], y[TREE_GROUP], xv[TREE_GROUP], yv[TREE_GROUP];
+  float xa[TREE_GROUP], ya[TREE_GROUP], near[TREE_GROUP];
+  Interaction_List &list;
+  const Sim_Params &sp;
+
+  Tree_Group(Interaction_List &l, const Sim_Params &params) : list(l), sp(params) {}
+
+  int size() const {
+    return TREE_GROUP;
+  }
+
+  __attribute__((always_inline)) void drift(float c) {
+    const float h = c * sp.dt;
+    for (int k = 0; k < TREE_GROUP; ++k) {
+      x[k] += xv[k] * h;
+      y[k] += yv[k] * h;
+    }
+  }
+
+  __attribute__((always_inline)) void kick(float c) {
+    const float h = c * sp.dt;
+    for (int k = 0; k < TREE_GROUP; ++k) {
+      xv[k] += xa[k] * h;
+      yv[k] += ya[k] * h;
+    }
+  }
+
+  __attribute__((always_inline)) void pull() {
+    float x0 = INFINITY, y0 = INFINITY, x1 = -INFINITY, y1 = -INFINITY;
+    for (int k = 0; k < TREE_GROUP; ++k) {
+      x0 = std::min(x0, x[k]);
+      y0 = std::min(y0, y[k]);
+      x1 = std::max(x1, x[k]);
+      y1 = std::max(y1, y[k]);
+    }
+    float bx0, by0, bx1, by1;
+    tree_box(x0, y0, x1, y1, bx0, by0, bx1, by1);
+    if (!list.built_for(bx0, by0, bx1, by1)) {
+      sp.tree->interactions(bx0, by0, bx1, by1, list);
+    }
+
+    V px[NV], py[NV], xacc[NV], yacc[NV], nearest[NV];
+    for (int v = 0; v < NV; ++v) {
+      memcpy(&px[v], x + v * W, sizeof(V));
+      memcpy(&py[v], y + v * W, sizeof(V));
+      xacc[v] = V{};
+      yacc[v] = V{};
+      nearest[v] = INFINITY - V{};
+    }
+    const float *lx = list.x.data(), *ly = list.y.data(), *lg = list.g.data();
+    for (int m = 0; m < list.size(); ++m) {
+#pragma GCC unroll 16
+      for (int v = 0; v < NV; ++v) {
+	V dx = lx[m] - px[v];
+	V dy = ly[m] - py[v];
+	V d = (dx * dx) + (dy * dy);
+	V f = lg[m] / (d + sp.softening);
+	xacc[v] += dx * f;
+	yacc[v] += dy * f;
+	nearest[v] = d < nearest[v] ? d : nearest[v];
+      }
+    }
+    for (int v = 0; v < NV; ++v) {
+      memcpy(xa + v * W, &xacc[v], sizeof(V));
+      memcpy(ya + v * W, &yacc[v], sizeof(V));
+      memcpy(near + v * W, &nearest[v], sizeof(V));
+    }
+  }
+};
+
+template<typename V, typename P>
+__attribute__((always_inline))
+inline void integrate_span_tree_body(const Span &s, int steps, const Sim_Params &sp) {
+  static thread_local Interaction_List list;
+
+  for (int i0 = 0; i0 < s.n; i0 += TREE_GROUP) {
+    const int n = std::min(TREE_GROUP, s.n - i0);
+    // A short group at the end of the span is padded with copies of its
+    // first particle, which leave the bounding box as it is. The list of
+    // the last group may come from another tree, so it is not reused.
+    list.clear();
+    Tree_Group<V> g(list, sp);
+    for (int k = 0; k < TREE_GROUP; ++k) {
+      int i = i0 + (k < n ? k : 0);
+      g.x[k] = s.x[i];
+      g.y[k] = s.y[i];
+      g.xv[k] = s.xv[i];
+      g.yv[k] = s.yv[i];
+      g.xa[k] = s.xa[i];
+      g.ya[k] = s.ya[i];
+    }
+    find_near(g);
+    for (int j = 0; j < steps; ++j) {
+      step_encounters<P>(g);
+    }
+    for (int k = 0; k < n; ++k) {
+      s.x[i0 + k] = g.x[k];
+      s.y[i0 + k] = g.y[k];
+      s.xv[i0 + k] = g.xv[k];
+      s.yv[i0 + k] = g.yv[k];
+      s.xa[i0 + k] = g.xa[k];
+      s.ya[i0 + k] = g.ya[k];
+    }
+  }
+}
+
+template<typename P>
+void integrate_span_tree_scalar(const Span &s, int steps, const Sim_Params &sp) {
+  integrate_span_tree_body<float, P>(s, steps, sp);
+}
+
+#if GS_X86
+
+template<typename P>
+__attribute__((target("sse2")))
+void integrate_span_tree_sse2(const Span &s, int steps, const Sim_Params &sp) {
+  integrate_span_tree_body<v4sf, P>(s, steps, sp);
+}
+
+template<typename P>
+__attribute__((target("avx2")))
+void integrate_span_tree_avx2(const Span &s, int steps, const Sim_Params &sp) {
+  integrate_span_tree_body<v8sf, P>(s, steps, sp);
+}
+
+template<typename P>
+__attribute__((target("avx512f")))
+void integrate_span_tree_avx512(const Span &s, int steps, const Sim_Params &sp) {
+  integrate_span_tree_body<v16sf, P>(s, steps, sp);
+}
+
+#endif
+
+// Tree kernel for the instruction set. The scalar one already interleaves
+// the particles of a group, so it doubles as the interleaved level.
+template<typename P>
+inline Span_Kernel tree_span_kernel(Simd_Level l) {
+  switch (l) {
+#if GS_X86
+  case SIMD_SSE2: return integrate_span_tree_sse2<P>;
+  case SIMD_AVX2: return integrate_span_tree_avx2<P>;
+  case SIMD_AVX512: return integrate_span_tree_avx512<P>;
+#endif
+  default: return integrate_span_tree_scalar<P>;
+  }
+}
+
+inline Span_Kernel tree_span_kernel(Simd_Level l, Integrator i = INTEGRATOR_EULER) {
+  GS_POLICY_DISPATCH(tree_span_kernel, i, (l))
+}
+
+#endif
@@ -0,0 +1,83 @@
+#ifndef GRAVITY_SNAPSHOT_MAPPED_FILE_H
+#define GRAVITY_SNAPSHOT_MAPPED_FILE_H
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Scratch file that memory is allocated from, for renders whose state does
+// not fit in RAM. Every allocation maps a new, disk backed part of the file,
+// so the kernel can write pages back and evict them instead of running out
+// of memory. The file is unlinked as soon as it is created and disappears
+// with the process.
+class Mapped_File {
+public:
+  explicit Mapped_File(const std::string &path) {
+    fd = open(path.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd >= 0) {
+      unlink(path.c_str());
+    }
+    page = sysconf(_SC_PAGESIZE);
+  }
+
+  ~Mapped_File() {
+    for (const auto &m : maps) {
+      munmap(m.first, m.second);
+    }
+    if (fd >= 0) {
+      close(fd);
+    }
+  }
+
+  Mapped_File(const Mapped_File &) = delete;
+  Mapped_File &operator=(const Mapped_File &) = delete;
+
+  bool ok() const {
+    return fd >= 0;
+  }
+
+  // Page aligned and zero filled, or null if the disk is full. The space is
+  // reserved up front, so running out of it later cannot crash the render.
+  void *allocate(size_t bytes) {
+    const size_t len = (bytes + page - 1) / page * page;
+    if (len == 0 || posix_fallocate(fd, size, len) != 0) {
+      return nullptr;
+    }
+    void *mem = mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, size);
+    if (mem == MAP_FAILED) {
+      return nullptr;
+    }
+    maps.emplace_back(mem, len);
+    size += len;
+    return mem;
+  }
+
+  // Hint that [mem, mem + bytes) is done with for now: the pages it touches
+  // are unmapped from the process, and the kernel writes back the changed
+  // ones and frees them when it needs the memory. The contents stay the
+  // same, so pages shared with memory still in use are fine to include.
+  void release(const void *mem, size_t bytes) {
+    uintptr_t begin = (uintptr_t)mem / page * page;
+    uintptr_t end = ((uintptr_t)mem + bytes + page - 1) / page * page;
+    if (end > begin) {
+      madvise((void *)begin, end - begin, MADV_DONTNEED);
+    }
+  }
+
+  size_t bytes() const {
+    return size;
+  }
+
+private:
+  int fd = -1;
+  size_t page = 4096;
+  size_t size = 0;
+  std::vector<std::pair<void *, size_t> > maps;
+};
+
+#endif
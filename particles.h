@@ -0,0 +1,410 @@
+#ifndef GRAVITY_SNAPSHOT_PARTICLES_H
+#define GRAVITY_SNAPSHOT_PARTICLES_H
+
+#include "mapped-file.h"
+#include <cstddef>
+#include <cstdint>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <vector>
+
+// Byte alignment of every array and of the start of every row. One cache
+// line, which is also the width of an AVX-512 register.
+const size_t PARTICLE_ALIGN = 64;
+
+// IEEE half precision floats, for the compact state. Rounds to nearest
+// even. Finite values beyond the largest half (65504) are clamped to it
+// rather than turned into infinities.
+inline uint16_t float_to_half(float f) {
+  uint32_t b;
+  memcpy(&b, &f, sizeof(b));
+  const uint16_t sign = (b >> 16) & 0x8000;
+  const uint32_t a = b & 0x7fffffff;
+  if (a > 0x7f800000) {
+    return sign | 0x7e00; // NaN
+  } else if (a >= 0x477ff000) {
+    return sign | 0x7bff; // 65520 and up would round to infinity
+  } else if (a < 0x38800000) {
+    // Subnormal, in units of 2^-24
+    float v;
+    memcpy(&v, &a, sizeof(v));
+    return sign | (uint16_t)lrintf(v * 16777216.0f);
+  }
+  // Rebias the exponent from 127 to 15, then round off 13 mantissa bits
+  uint32_t m = a - 0x38000000;
+  m += 0xfff + ((m >> 13) & 1);
+  return sign | (uint16_t)(m >> 13);
+}
+
+inline float half_to_float(uint16_t h) {
+  const uint32_t e = (h >> 10) & 0x1f;
+  const uint32_t m = h & 0x3ff;
+  if (e == 0) {
+    float f = m * (1.0f / 16777216.0f);
+    return (h & 0x8000) ? -f : f;
+  }
+  uint32_t b = (uint32_t)(h & 0x8000) << 16 | (e == 31 ? 0x7f800000 : (e + 112) << 23) | m << 13;
+  float f;
+  memcpy(&f, &b, sizeof(f));
+  return f;
+}
+
+// A contiguous run of particles inside one row, as seen by the integrator.
+struct Span {
+  float *x;
+  float *y;
+  float *xv;
+  float *yv;
+  float *xa;
+  float *ya;
+  int n;
+  float *h; // step size of each particle for adaptive integrators, or null
+  void *wide; // state of each particle in the -precision type, or null
+};
+
+// Simulation state for every pixel of the frame, stored structure-of-arrays:
+// one contiguous array per component instead of a grid of Points. Rows are
+// padded to a multiple of PARTICLE_ALIGN bytes so that every row starts on
+// an aligned address and can be streamed through the integrator as a whole.
+//
+// Compact particles (-compact) keep each particle in COMPACT_HALVES half
+// precision floats instead, 8 bytes rather than 24: its offset from its own
+// pixel and its velocity. The pull is not kept at all. Rows are unpacked
+// into float arrays for the kernels and packed again afterwards, and the
+// six float arrays are not allocated.
+const int COMPACT_HALVES = 4;
+
+struct Particles {
+  int width = 0;
+  int height = 0;
+  size_t stride = 0; // floats per row, including padding
+  float *x = nullptr;
+  float *y = nullptr;
+  float *xv = nullptr;
+  float *yv = nullptr;
+  float *xa = nullptr;
+  float *ya = nullptr;
+
+  // Capture tracking, only allocated by track_captures()
+  int32_t *captured = nullptr;     // index of the capturing mass, -1 while free
+  int64_t *capture_step = nullptr; // total step count when it was captured
+  uint8_t *bound_checks = nullptr; // consecutive checks it was found bound in
+
+  // Step size of each particle, only allocated by track_step_size(). 0 until
+  // the adaptive integrator has picked one.
+  float *step_size = nullptr;
+
+  // State in a wider number type than float (-precision), wide_size bytes per
+  // particle, only allocated by track_wide(). The float arrays above are
+  // kept as its rounded copy. Filled in by the kernel's type, see
+  // precision.h.
+  unsigned char *wide = nullptr;
+  size_t wide_size = 0;
+
+  // Compact state, dx, dy, xv, yv for every particle, in place of the float
+  // arrays
+  uint16_t *packed = nullptr;
+
+  // Scratch file every array is allocated from (out of core), or null for
+  // the heap. Has to outlive the Particles.
+  Mapped_File *file = nullptr;
+
+  Particles(int w, int h, bool compact = false, Mapped_File *f = nullptr)
+    : width(w), height(h), stride(row_stride(w)), file(f) {
+    if (compact) {
+      packed = (uint16_t *)allocate(stride * height * sizeof(uint16_t[COMPACT_HALVES]));
+      if (!packed) {
+	throw std::bad_alloc();
+      }
+      return;
+    }
+    float **arrays[] = {&x, &y, &xv, &yv, &xa, &ya};
+    for (float **a : arrays) {
+      *a = (float *)allocate(bytes_per_array());
+      if (!*a) {
+	free_arrays();
+	throw std::bad_alloc();
+      }
+    }
+  }
+
+  ~Particles() {
+    free_arrays();
+  }
+
+  void track_captures() {
+    const size_t n = stride * height;
+    void *mem[3] = {allocate(n * sizeof(int32_t)), allocate(n * sizeof(int64_t)),
+		    allocate(n * sizeof(uint8_t))};
+    if (!mem[0] || !mem[1] || !mem[2]) {
+      release(mem[0]);
+      release(mem[1]);
+      release(mem[2]);
+      throw std::bad_alloc();
+    }
+    captured = (int32_t *)mem[0];
+    capture_step = (int64_t *)mem[1];
+    bound_checks = (uint8_t *)mem[2];
+    reset_captures();
+  }
+
+  void track_step_size() {
+    step_size = (float *)allocate(bytes_per_array());
+    if (!step_size) {
+      throw std::bad_alloc();
+    }
+    reset_step_size();
+  }
+
+  void track_wide(size_t bytes_per_particle) {
+    wide = (unsigned char *)allocate(stride * height * bytes_per_particle);
+    if (!wide) {
+      throw std::bad_alloc();
+    }
+    wide_size = bytes_per_particle;
+  }
+
+  Particles(const Particles &) = delete;
+  Particles &operator=(const Particles &) = delete;
+
+  size_t bytes_per_array() const {
+    return stride * height * sizeof(float);
+  }
+
+  size_t bytes() const {
+    return bytes(width, height, packed, captured, step_size, wide_size);
+  }
+
+  // What bytes() will be for Particles(w, h, compact) once the optional
+  // arrays have been added
+  static size_t bytes(int w, int h, bool compact, bool captures, bool step_size,
+		      size_t wide_size) {
+    const size_t n = row_stride(w) * h;
+    size_t b = n * (compact ? sizeof(uint16_t[COMPACT_HALVES]) : 6 * sizeof(float));
+    if (captures) {
+      b += n * (sizeof(int32_t) + sizeof(int64_t) + sizeof(uint8_t));
+    }
+    if (step_size) {
+      b += n * sizeof(float);
+    }
+    return b + n * wide_size;
+  }
+
+  // An allocated array, under a name that stays the same across versions
+  struct Array {
+    const char *name;
+    void *data;
+    size_t bytes;
+  };
+
+  // Every allocated array, which together are the whole state
+  std::vector<Array> arrays() const {
+    const size_t n = stride * height;
+    const Array all[] = {
+      {"x", x, n * sizeof(float)},
+      {"y", y, n * sizeof(float)},
+      {"xv", xv, n * sizeof(float)},
+      {"yv", yv, n * sizeof(float)},
+      {"xa", xa, n * sizeof(float)},
+      {"ya", ya, n * sizeof(float)},
+      {"packed", packed, n * sizeof(uint16_t[COMPACT_HALVES])},
+      {"captured", captured, n * sizeof(int32_t)},
+      {"capture_step", capture_step, n * sizeof(int64_t)},
+      {"bound_checks", bound_checks, n * sizeof(uint8_t)},
+      {"step_size", step_size, n * sizeof(float)},
+      {"wide", wide, n * wide_size},
+    };
+    std::vector<Array> v;
+    for (const Array &a : all) {
+      if (a.data) {
+	v.push_back(a);
+      }
+    }
+    return v;
+  }
+
+  // Out of core: drops rows [y0, y1) from memory until they are next used,
+  // see Mapped_File::release()
+  void release_rows(int y0, int y1) {
+    if (!file) {
+      return;
+    }
+    const size_t i = index(0, y0), n = (y1 - y0) * stride;
+    float *arrays[] = {x, y, xv, yv, xa, ya, step_size};
+    for (float *a : arrays) {
+      if (a) {
+	file->release(a + i, n * sizeof(float));
+      }
+    }
+    if (packed) {
+      file->release(packed + i * COMPACT_HALVES, n * sizeof(uint16_t[COMPACT_HALVES]));
+    }
+    if (captured) {
+      file->release(captured + i, n * sizeof(int32_t));
+      file->release(capture_step + i, n * sizeof(int64_t));
+      file->release(bound_checks + i, n * sizeof(uint8_t));
+    }
+    if (wide) {
+      file->release(wide + i * wide_size, n * wide_size);
+    }
+  }
+
+  size_t index(int px, int py) const {
+    return (size_t)py * stride + px;
+  }
+
+  // Particles [x0, x1) of row py. Not for compact particles, see unpack_row()
+  Span row(int py, int x0, int x1) const {
+    size_t i = index(x0, py);
+    return Span{x + i, y + i, xv + i, yv + i, xa + i, ya + i, x1 - x0,
+		step_size ? step_size + i : nullptr, wide ? wide + i * wide_size : nullptr};
+  }
+
+  // Compact particles [x0, x1) of row py, unpacked into six arrays of
+  // buf_stride floats each at buf. The pull is set to 0.
+  Span unpack_row(int py, int x0, int x1, float *buf, size_t buf_stride) const {
+    size_t i = index(x0, py);
+    Span s = {buf, buf + buf_stride, buf + 2 * buf_stride, buf + 3 * buf_stride,
+	      buf + 4 * buf_stride, buf + 5 * buf_stride, x1 - x0,
+	      step_size ? step_size + i : nullptr, nullptr};
+    for (int k = 0; k < s.n; ++k) {
+      const uint16_t *q = packed + (i + k) * COMPACT_HALVES;
+      s.x[k] = (x0 + k) + half_to_float(q[0]);
+      s.y[k] = py + half_to_float(q[1]);
+      s.xv[k] = half_to_float(q[2]);
+      s.yv[k] = half_to_float(q[3]);
+      s.xa[k] = 0;
+      s.ya[k] = 0;
+    }
+    return s;
+  }
+
+  // Stores s, unpacked from row py starting at x0, back into the compact state
+  void pack_row(int py, int x0, const Span &s) {
+    size_t i = index(x0, py);
+    for (int k = 0; k < s.n; ++k) {
+      uint16_t *q = packed + (i + k) * COMPACT_HALVES;
+      q[0] = float_to_half(s.x[k] - (x0 + k));
+      q[1] = float_to_half(s.y[k] - py);
+      q[2] = float_to_half(s.xv[k]);
+      q[3] = float_to_half(s.yv[k]);
+    }
+  }
+
+  // Position of particle (px, py), compact or not
+  void position(int px, int py, float &x_out, float &y_out) const {
+    const size_t i = index(px, py);
+    if (packed) {
+      x_out = px + half_to_float(packed[i * COMPACT_HALVES]);
+      y_out = py + half_to_float(packed[i * COMPACT_HALVES + 1]);
+    } else {
+      x_out = x[i];
+      y_out = y[i];
+    }
+  }
+
+  // Copies compact particle i to k, negating its offset and velocity along
+  // x and/or y. This mirrors it exactly when k is i's mirror pixel.
+  void mirror_packed(size_t i, size_t k, bool flip_x, bool flip_y) {
+    const uint16_t *q = packed + i * COMPACT_HALVES;
+    uint16_t *r = packed + k * COMPACT_HALVES;
+    const uint16_t fx = flip_x ? 0x8000 : 0, fy = flip_y ? 0x8000 : 0;
+    r[0] = q[0] ^ fx;
+    r[1] = q[1] ^ fy;
+    r[2] = q[2] ^ fx;
+    r[3] = q[3] ^ fy;
+  }
+
+  // Put every particle at rest on its own pixel. The row padding is filled
+  // in as well so it always holds finite values.
+  void reset() {
+    if (packed) {
+      for (int py = 0; py < height; ++py) {
+	memset(packed + index(0, py) * COMPACT_HALVES, 0, stride * sizeof(uint16_t[COMPACT_HALVES]));
+	release_rows(py, py + 1);
+      }
+      reset_captures();
+      reset_step_size();
+      return;
+    }
+    for (int py = 0; py < height; ++py) {
+      for (int px = 0; px < (int)stride; ++px) {
+	size_t i = index(px, py);
+	x[i] = px;
+	y[i] = py;
+	xv[i] = 0;
+	yv[i] = 0;
+	xa[i] = 0;
+	ya[i] = 0;
+      }
+      release_rows(py, py + 1);
+    }
+    reset_captures();
+    reset_step_size();
+  }
+
+private:
+  void reset_captures() {
+    if (!captured) {
+      return;
+    }
+    for (size_t i = 0; i < stride * height; ++i) {
+      captured[i] = -1;
+      capture_step[i] = 0;
+      bound_checks[i] = 0;
+    }
+  }
+
+  void reset_step_size() {
+    if (!step_size) {
+      return;
+    }
+    for (size_t i = 0; i < stride * height; ++i) {
+      step_size[i] = 0;
+    }
+  }
+
+  static size_t row_stride(int w) {
+    const size_t per_line = PARTICLE_ALIGN / sizeof(float);
+    return (w + per_line - 1) / per_line * per_line;
+  }
+
+  void *allocate(size_t bytes) {
+    if (file) {
+      return file->allocate(bytes);
+    }
+    void *mem = nullptr;
+    return posix_memalign(&mem, PARTICLE_ALIGN, bytes) == 0 ? mem : nullptr;
+  }
+
+  // The file's mappings are only undone along with the file
+  void release(void *mem) {
+    if (!file) {
+      free(mem);
+    }
+  }
+
+  void free_arrays() {
+    float **arrays[] = {&x, &y, &xv, &yv, &xa, &ya};
+    for (float **a : arrays) {
+      release(*a);
+      *a = nullptr;
+    }
+    release(captured);
+    release(capture_step);
+    release(bound_checks);
+    release(step_size);
+    release(wide);
+    release(packed);
+    captured = nullptr;
+    capture_step = nullptr;
+    bound_checks = nullptr;
+    step_size = nullptr;
+    wide = nullptr;
+    packed = nullptr;
+  }
+};
+
+#endif
@@ -0,0 +1,629 @@
+#ifndef GRAVITY_SNAPSHOT_PNG_WRITER_H
+#define GRAVITY_SNAPSHOT_PNG_WRITER_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <queue>
+#include <vector>
+
+// A small, dependency free PNG encoder for 8 bit RGB images. Rows are
+// filtered, deflated and written out as they come in, so neither the whole
+// image nor the whole compressed stream has to be held in memory.
+//
+// The compression level works like zlib's: 0 stores the data uncompressed,
+// 1-9 use LZ77 with dynamic Huffman codes and search increasingly long match
+// chains, trading encode speed for size.
+
+namespace png {
+
+struct Crc_Table {
+  uint32_t entry[256];
+  Crc_Table() {
+    for (uint32_t n = 0; n < 256; ++n) {
+      uint32_t c = n;
+      for (int k = 0; k < 8; ++k) {
+	c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+      }
+      entry[n] = c;
+    }
+  }
+};
+
+inline uint32_t crc32(uint32_t crc, const unsigned char *buf, size_t len) {
+  static const Crc_Table table;
+  crc ^= 0xffffffffu;
+  for (size_t i = 0; i < len; ++i) {
+    crc = table.entry[(crc ^ buf[i]) & 0xff] ^ (crc >> 8);
+  }
+  return crc ^ 0xffffffffu;
+}
+
+// Builds the Huffman code lengths for the given symbol frequencies, none of
+// them longer than max_bits. Unused symbols get length 0. Always returns at
+// least two used codes so that every code is complete.
+inline void huffman_lengths(std::vector<uint32_t> freq, int max_bits, std::vector<uint8_t> &lengths) {
+  const int n = freq.size();
+  lengths.assign(n, 0);
+  int used = 0;
+  for (int i = 0; i < n; ++i) {
+    used += freq[i] > 0;
+  }
+  for (int i = 0; used < 2 && i < n; ++i) {
+    if (freq[i] == 0) {
+      freq[i] = 1;
+      ++used;
+    }
+  }
+
+  while (true) {
+    // Nodes [0, n) are the symbols, the rest are internal
+    std::vector<int> parent(2 * n, -1);
+    typedef std::pair<uint64_t, int> Node;
+    std::priority_queue<Node, std::vector<Node>, std::greater<Node> > heap;
+    for (int i = 0; i < n; ++i) {
+      if (freq[i] > 0) {
+	heap.push(Node(freq[i], i));
+      }
+    }
+    int next = n;
+    while (heap.size() > 1) {
+      Node a = heap.top();
+      heap.pop();
+      Node b = heap.top();
+      heap.pop();
+      parent[a.second] = next;
+      parent[b.second] = next;
+      heap.push(Node(a.first + b.first, next));
+      ++next;
+    }
+
+    int longest = 0;
+    for (int i = 0; i < n; ++i) {
+      if (freq[i] == 0) {
+	continue;
+      }
+      int depth = 0;
+      for (int p = parent[i]; p != -1; p = parent[p]) {
+	++depth;
+      }
+      lengths[i] = depth;
+      longest = std::max(longest, depth);
+    }
+    if (longest <= max_bits) {
+      return;
+    }
+    // Flatten the distribution and try again
+    for (int i = 0; i < n; ++i) {
+      if (freq[i] > 0) {
+	freq[i] = (freq[i] + 1) / 2;
+      }
+    }
+  }
+}
+
+// Canonical codes for the given lengths, bit reversed because deflate sends
+// Huffman codes most significant bit first into an LSB first stream
+inline void huffman_codes(const std::vector<uint8_t> &lengths, std::vector<uint16_t> &codes) {
+  int count[16] = {0};
+  for (uint8_t l : lengths) {
+    ++count[l];
+  }
+  count[0] = 0;
+  int next[16] = {0};
+  int code = 0;
+  for (int bits = 1; bits < 16; ++bits) {
+    code = (code + count[bits - 1]) << 1;
+    next[bits] = code;
+  }
+  codes.assign(lengths.size(), 0);
+  for (size_t i = 0; i < lengths.size(); ++i) {
+    int len = lengths[i];
+    if (len == 0) {
+      continue;
+    }
+    int c = next[len]++;
+    int rev = 0;
+    for (int b = 0; b < len; ++b) {
+      rev = (rev << 1) | ((c >> b) & 1);
+    }
+    codes[i] = rev;
+  }
+}
+
+const uint16_t length_base[29] = {3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+				  35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+const uint8_t length_extra[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+				  3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+const uint16_t dist_base[30] = {1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+				257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145,
+				8193, 12289, 16385, 24577};
+const uint8_t dist_extra[30] = {0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+				7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+const uint8_t code_length_order[19] = {16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+
+// Streaming zlib (RFC 1950/1951) compressor. Compressed bytes are handed to
+// `sink` as they are produced.
+class Deflater {
+public:
+  typedef void (*Sink)(void *ctx, const unsigned char *data, size_t len);
+
+  Deflater(int compression, Sink out_sink, void *out_ctx)
+    : level(std::min(std::max(compression, 0), 9)), sink(out_sink), ctx(out_ctx) {
+    static const int chain_for_level[10] = {0, 4, 8, 16, 32, 64, 128, 256, 1024, 4096};
+    max_chain = chain_for_level[level];
+    head.assign(HASH_SIZE, -1);
+    prev.assign(WINDOW, -1);
+  }
+
+  void write(const unsigned char *data, size_t len) {
+    start();
+    for (size_t i = 0; i < len; ++i) {
+      uint32_t a = adler & 0xffff, b = adler >> 16;
+      a = (a + data[i]) % 65521;
+      b = (b + a) % 65521;
+      adler = (b << 16) | a;
+    }
+    buf.insert(buf.end(), data, data + len);
+    while (buf.size() - (size_t)(pos - base) >= BLOCK_INPUT + MAX_MATCH) {
+      compress_block(BLOCK_INPUT, false);
+    }
+  }
+
+  void finish() {
+    start();
+    compress_block(buf.size() - (pos - base), true);
+    flush_bits();
+    unsigned char trailer[4] = {(unsigned char)(adler >> 24), (unsigned char)(adler >> 16),
+				(unsigned char)(adler >> 8), (unsigned char)adler};
+    emit(trailer, 4);
+  }
+
+private:
+  static const int WINDOW = 32768;
+  static const int HASH_BITS = 15;
+  static const int HASH_SIZE = 1 << HASH_BITS;
+  static const int MIN_MATCH = 3;
+  static const int MAX_MATCH = 258;
+  static const size_t BLOCK_INPUT = 1 << 16;
+
+  void emit(const unsigned char *data, size_t len) {
+    sink(ctx, data, len);
+  }
+
+  // The zlib header goes out with the first data rather than from the
+  // constructor, so the sink can belong to an object still being built
+  void start() {
+    if (started) {
+      return;
+    }
+    started = true;
+    unsigned char header[2] = {0x78, (unsigned char)(level == 0 ? 0x01 : level < 6 ? 0x5e : level == 6 ? 0x9c : 0xda)};
+    emit(header, 2);
+  }
+
+  void put_bits(uint32_t value, int count) {
+    bit_buf |= (uint64_t)value << bit_count;
+    bit_count += count;
+    while (bit_count >= 8) {
+      out.push_back((unsigned char)bit_buf);
+      bit_buf >>= 8;
+      bit_count -= 8;
+    }
+  }
+
+  void flush_bits() {
+    if (bit_count > 0) {
+      out.push_back((unsigned char)bit_buf);
+    }
+    bit_buf = 0;
+    bit_count = 0;
+    flush_out();
+  }
+
+  void flush_out() {
+    if (!out.empty()) {
+      emit(out.data(), out.size());
+      out.clear();
+    }
+  }
+
+  unsigned char at(int64_t p) const {
+    return buf[p - base];
+  }
+
+  uint32_t hash(int64_t p) const {
+    uint32_t h = (at(p) << 10) ^ (at(p + 1) << 5) ^ at(p + 2);
+    return (h * 2654435761u) >> (32 - HASH_BITS);
+  }
+
+  void insert(int64_t p, int64_t end) {
+    if (p + MIN_MATCH > end) {
+      return;
+    }
+    uint32_t h = hash(p);
+    prev[p & (WINDOW - 1)] = head[h];
+    head[h] = p;
+  }
+
+  // Longest earlier match for position p, not reaching past end
+  int find_match(int64_t p, int64_t end, int &dist) {
+    int best = 0;
+    if (p + MIN_MATCH > end) {
+      return 0;
+    }
+    int limit = (int)std::min<int64_t>(MAX_MATCH, end - p);
+    int64_t cand = head[hash(p)];
+    for (int chain = 0; cand >= 0 && p - cand <= WINDOW && chain < max_chain; ++chain) {
+      if (at(cand + best) == at(p + best)) {
+	int len = 0;
+	while (len < limit && at(cand + len) == at(p + len)) {
+	  ++len;
+	}
+	if (len > best) {
+	  best = len;
+	  dist = p - cand;
+	  if (len == limit) {
+	    break;
+	  }
+	}
+      }
+      int64_t next = prev[cand & (WINDOW - 1)];
+      if (next >= cand) {
+	break;
+      }
+      cand = next;
+    }
+    return best >= MIN_MATCH ? best : 0;
+  }
+
+  // Compress the next `len` input bytes as one deflate block
+  void compress_block(size_t len, bool last) {
+    int64_t end = pos + len;
+    if (level == 0) {
+      store_block(end, last);
+    } else {
+      // Symbols: literal/length code (0-285) with extra bits, then the
+      // distance code with its extra bits. Stored as (lit_len, dist) pairs,
+      // dist == 0 for literals.
+      std::vector<uint32_t> syms;
+      syms.reserve(len);
+      std::vector<uint32_t> lit_freq(286, 0), dist_freq(30, 0);
+      while (pos < end) {
+	int dist = 0;
+	int match = find_match(pos, end, dist);
+	if (match) {
+	  int lc = 0;
+	  while (lc < 28 && length_base[lc + 1] <= match) {
+	    ++lc;
+	  }
+	  int dc = 0;
+	  while (dc < 29 && dist_base[dc + 1] <= dist) {
+	    ++dc;
+	  }
+	  ++lit_freq[257 + lc];
+	  ++dist_freq[dc];
+	  syms.push_back(match);
+	  syms.push_back(dist);
+	  for (int k = 0; k < match; ++k) {
+	    insert(pos + k, end);
+	  }
+	  pos += match;
+	} else {
+	  ++lit_freq[at(pos)];
+	  syms.push_back(at(pos));
+	  syms.push_back(0);
+	  insert(pos, end);
+	  ++pos;
+	}
+      }
+      ++lit_freq[256];
+      huffman_block(syms, lit_freq, dist_freq, last);
+    }
+
+    // Keep one window of history for matches in the next block
+    int64_t keep_from = std::max(base, pos - WINDOW);
+    if (keep_from - base > (int64_t)BLOCK_INPUT) {
+      buf.erase(buf.begin(), buf.begin() + (keep_from - base));
+      base = keep_from;
+    }
+    flush_out();
+  }
+
+  void store_block(int64_t end, bool last) {
+    do {
+      size_t n = std::min<int64_t>(end - pos, 65535);
+      put_bits(last && pos + (int64_t)n == end ? 1 : 0, 1);
+      put_bits(0, 2);
+      flush_bits();
+      unsigned char header[4] = {(unsigned char)n, (unsigned char)(n >> 8),
+				 (unsigned char)~n, (unsigned char)(~n >> 8)};
+      out.insert(out.end(), header, header + 4);
+      out.insert(out.end(), buf.begin() + (pos - base), buf.begin() + (pos - base) + n);
+      pos += n;
+    } while (pos < end);
+  }
+
+  void huffman_block(const std::vector<uint32_t> &syms, const std::vector<uint32_t> &lit_freq,
+		     const std::vector<uint32_t> &dist_freq, bool last) {
+    std::vector<uint8_t> lit_len, dist_len;
+    huffman_lengths(lit_freq, 15, lit_len);
+    huffman_lengths(dist_freq, 15, dist_len);
+    std::vector<uint16_t> lit_code, dist_code;
+    huffman_codes(lit_len, lit_code);
+    huffman_codes(dist_len, dist_code);
+
+    int hlit = 286;
+    while (hlit > 257 && lit_len[hlit - 1] == 0) {
+      --hlit;
+    }
+    int hdist = 30;
+    while (hdist > 1 && dist_len[hdist - 1] == 0) {
+      --hdist;
+    }
+
+    // Run length encode both code length tables together
+    std::vector<uint8_t> all(lit_len.begin(), lit_len.begin() + hlit);
+    all.insert(all.end(), dist_len.begin(), dist_len.begin() + hdist);
+    std::vector<std::pair<int, int> > cl_syms; // symbol, extra bits value
+    std::vector<uint32_t> cl_freq(19, 0);
+    for (size_t i = 0; i < all.size();) {
+      size_t run = 1;
+      while (i + run < all.size() && all[i + run] == all[i]) {
+	++run;
+      }
+      if (all[i] == 0 && run >= 3) {
+	int n = std::min<size_t>(run, 138);
+	if (n >= 11) {
+	  cl_syms.push_back(std::make_pair(18, n - 11));
+	  ++cl_freq[18];
+	} else {
+	  cl_syms.push_back(std::make_pair(17, n - 3));
+	  ++cl_freq[17];
+	}
+	i += n;
+      } else if (all[i] != 0 && run >= 4) {
+	cl_syms.push_back(std::make_pair(all[i], 0));
+	++cl_freq[all[i]];
+	int n = std::min<size_t>(run - 1, 6);
+	cl_syms.push_back(std::make_pair(16, n - 3));
+	++cl_freq[16];
+	i += 1 + n;
+      } else {
+	cl_syms.push_back(std::make_pair(all[i], 0));
+	++cl_freq[all[i]];
+	++i;
+      }
+    }
+    std::vector<uint8_t> cl_len;
+    std::vector<uint16_t> cl_code;
+    huffman_lengths(cl_freq, 7, cl_len);
+    huffman_codes(cl_len, cl_code);
+    int hclen = 19;
+    while (hclen > 4 && cl_len[code_length_order[hclen - 1]] == 0) {
+      --hclen;
+    }
+
+    put_bits(last ? 1 : 0, 1);
+    put_bits(2, 2);
+    put_bits(hlit - 257, 5);
+    put_bits(hdist - 1, 5);
+    put_bits(hclen - 4, 4);
+    for (int i = 0; i < hclen; ++i) {
+      put_bits(cl_len[code_length_order[i]], 3);
+    }
+    for (auto &c : cl_syms) {
+      put_bits(cl_code[c.first], cl_len[c.first]);
+      if (c.first == 16) {
+	put_bits(c.second, 2);
+      } else if (c.first == 17) {
+	put_bits(c.second, 3);
+      } else if (c.first == 18) {
+	put_bits(c.second, 7);
+      }
+    }
+
+    for (size_t i = 0; i < syms.size(); i += 2) {
+      uint32_t dist = syms[i + 1];
+      if (dist == 0) {
+	put_bits(lit_code[syms[i]], lit_len[syms[i]]);
+	continue;
+      }
+      int match = syms[i];
+      int lc = 0;
+      while (lc < 28 && length_base[lc + 1] <= match) {
+	++lc;
+      }
+      put_bits(lit_code[257 + lc], lit_len[257 + lc]);
+      put_bits(match - length_base[lc], length_extra[lc]);
+      int dc = 0;
+      while (dc < 29 && dist_base[dc + 1] <= (int)dist) {
+	++dc;
+      }
+      put_bits(dist_code[dc], dist_len[dc]);
+      put_bits(dist - dist_base[dc], dist_extra[dc]);
+      if (out.size() >= 1 << 16) {
+	flush_out();
+      }
+    }
+    put_bits(lit_code[256], lit_len[256]);
+  }
+
+  int level;
+  int max_chain;
+  Sink sink;
+  void *ctx;
+  bool started = false;
+  uint32_t adler = 1;
+
+  std::vector<unsigned char> buf; // input, starting at absolute position base
+  int64_t base = 0;
+  int64_t pos = 0;                // next input byte to compress
+  std::vector<int64_t> head;
+  std::vector<int64_t> prev;
+
+  std::vector<unsigned char> out;
+  uint64_t bit_buf = 0;
+  int bit_count = 0;
+};
+
+} // namespace png
+
+class Png_Writer {
+public:
+  // Writes the PNG signature and header. Check ok() afterwards.
+  Png_Writer(const char *filename, int w, int h, int compression)
+    : width(w), height(h), level(compression),
+      deflater(compression, &Png_Writer::deflate_sink, this) {
+    file = fopen(filename, "wb");
+    if (!file) {
+      return;
+    }
+    static const unsigned char signature[8] = {137, 80, 78, 71, 13, 10, 26, 10};
+    fwrite(signature, 1, 8, file);
+    unsigned char ihdr[13] = {0};
+    put_u32(ihdr, width);
+    put_u32(ihdr + 4, height);
+    ihdr[8] = 8; // bit depth
+    ihdr[9] = 2; // truecolor
+    write_chunk("IHDR", ihdr, 13);
+    prior.assign(3 * width, 0);
+    filtered.assign(1 + 3 * width, 0);
+  }
+
+  ~Png_Writer() {
+    if (file) {
+      finish();
+    }
+  }
+
+  bool ok() const {
+    return file != nullptr && !failed;
+  }
+
+  // Adds the next row of the image, as width interleaved RGB triples
+  void write_row(const unsigned char *rgb) {
+    if (!file) {
+      return;
+    }
+    filter_row(rgb);
+    deflater.write(filtered.data(), filtered.size());
+    memcpy(prior.data(), rgb, prior.size());
+    ++rows;
+  }
+
+  // Flushes the compressed data and closes the file. Returns false if
+  // anything could not be written.
+  bool finish() {
+    if (!file) {
+      return false;
+    }
+    if (rows != height) {
+      failed = true;
+    }
+    deflater.finish();
+    flush_idat();
+    write_chunk("IEND", nullptr, 0);
+    if (fclose(file) != 0) {
+      failed = true;
+    }
+    file = nullptr;
+    return !failed;
+  }
+
+private:
+  static void put_u32(unsigned char *p, uint32_t v) {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+  }
+
+  void write_chunk(const char *type, const unsigned char *data, size_t len) {
+    unsigned char header[8];
+    put_u32(header, len);
+    memcpy(header + 4, type, 4);
+    uint32_t crc = png::crc32(0, header + 4, 4);
+    if (len) {
+      crc = png::crc32(crc, data, len);
+    }
+    unsigned char trailer[4];
+    put_u32(trailer, crc);
+    if (fwrite(header, 1, 8, file) != 8 ||
+	(len && fwrite(data, 1, len, file) != len) ||
+	fwrite(trailer, 1, 4, file) != 4) {
+      failed = true;
+    }
+  }
+
+  static void deflate_sink(void *ctx, const unsigned char *data, size_t len) {
+    Png_Writer *w = (Png_Writer *)ctx;
+    w->idat.insert(w->idat.end(), data, data + len);
+    if (w->idat.size() >= IDAT_SIZE) {
+      w->flush_idat();
+    }
+  }
+
+  void flush_idat() {
+    if (!idat.empty()) {
+      write_chunk("IDAT", idat.data(), idat.size());
+      idat.clear();
+    }
+  }
+
+  static int paeth(int a, int b, int c) {
+    int p = a + b - c;
+    int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+    return (pa <= pb && pa <= pc) ? a : pb <= pc ? b : c;
+  }
+
+  // Filters the row into `filtered`. Stored output keeps it unfiltered,
+  // otherwise the filter with the smallest sum of absolute differences is
+  // used, the usual heuristic for picking PNG filters.
+  void filter_row(const unsigned char *rgb) {
+    const int n = 3 * width;
+    if (level == 0) {
+      filtered[0] = 0;
+      memcpy(filtered.data() + 1, rgb, n);
+      return;
+    }
+    unsigned long best_sum = ~0ul;
+    std::vector<unsigned char> &trial = scratch;
+    trial.resize(1 + n);
+    for (int type = 0; type <= 4; ++type) {
+      unsigned long sum = 0;
+      trial[0] = type;
+      for (int i = 0; i < n; ++i) {
+	int a = i >= 3 ? rgb[i - 3] : 0;
+	int b = prior[i];
+	int c = i >= 3 ? prior[i - 3] : 0;
+	int pred = type == 0 ? 0 : type == 1 ? a : type == 2 ? b : type == 3 ? (a + b) / 2 : paeth(a, b, c);
+	unsigned char v = rgb[i] - pred;
+	trial[1 + i] = v;
+	sum += v < 128 ? v : 256 - v;
+      }
+      if (sum < best_sum) {
+	best_sum = sum;
+	filtered.swap(trial);
+      }
+    }
+  }
+
+  static const size_t IDAT_SIZE = 1 << 16;
+
+  int width;
+  int height;
+  int level;
+  int rows = 0;
+  FILE *file = nullptr;
+  bool failed = false;
+  png::Deflater deflater;
+  std::vector<unsigned char> prior;
+  std::vector<unsigned char> filtered;
+  std::vector<unsigned char> scratch;
+  std::vector<unsigned char> idat;
+};
+
+#endif
@@ -0,0 +1,115 @@
+#ifndef GRAVITY_SNAPSHOT_POSITIONS_H
+#define GRAVITY_SNAPSHOT_POSITIONS_H
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+// Position files (-positions): where every pixel's point is at the end of a
+// frame, which is all the coloring needs. recolor turns them into images
+// without integrating anything again.
+//
+// The file, in the byte order of the machine that wrote it:
+//   "GSPOSITN"           magic
+//   u32                  POSITIONS_VERSION
+//   i32, i32             width, height
+//   i64                  steps integrated up to the frame
+//   u32                  flags, POSITIONS_CAPTURES
+//   u32, f32[n], f32[n]  masses: count, x, y
+// and then for each row, top to bottom:
+//   f32[width], f32[width]   x, y of the row's points
+//   i32[width], i64[width]   with POSITIONS_CAPTURES: the mass each point
+//                            was captured by or -1, and the step it was
+//                            captured at
+const uint32_t POSITIONS_VERSION = 2;
+const char POSITIONS_MAGIC[8] = {'G', 'S', 'P', 'O', 'S', 'I', 'T', 'N'};
+const uint32_t POSITIONS_CAPTURES = 1;
+
+struct Positions_Header {
+  int32_t width = 0;
+  int32_t height = 0;
+  int64_t steps = 0;
+  uint32_t flags = 0;
+  std::vector<float> mx, my;
+
+  bool captures() const {
+    return flags & POSITIONS_CAPTURES;
+  }
+
+  bool write(FILE *f) const {
+    uint32_t n = mx.size();
+    return fwrite(POSITIONS_MAGIC, sizeof(POSITIONS_MAGIC), 1, f) == 1 &&
+      put(f, POSITIONS_VERSION) && put(f, width) && put(f, height) && put(f, steps) &&
+      put(f, flags) && put(f, n) && fwrite(mx.data(), sizeof(float), n, f) == n &&
+      fwrite(my.data(), sizeof(float), n, f) == n;
+  }
+
+  // Returns false with error set if f is not a position file this version
+  // reads
+  bool read(FILE *f, std::string &error) {
+    char magic[sizeof(POSITIONS_MAGIC)];
+    uint32_t version = 0;
+    if (fread(magic, sizeof(magic), 1, f) != 1 ||
+	memcmp(magic, POSITIONS_MAGIC, sizeof(magic)) != 0 || !get(f, version)) {
+      error = "not a position file";
+      return false;
+    }
+    if (version != POSITIONS_VERSION) {
+      error = "a version " + std::to_string(version) + " position file, this program reads version " +
+	std::to_string(POSITIONS_VERSION);
+      return false;
+    }
+    uint32_t n = 0;
+    bool ok = get(f, width) && get(f, height) && get(f, steps) && get(f, flags) && get(f, n) &&
+      width > 0 && height > 0 && n < (1u << 24);
+    if (ok) {
+      mx.resize(n);
+      my.resize(n);
+      ok = fread(mx.data(), sizeof(float), n, f) == n && fread(my.data(), sizeof(float), n, f) == n;
+    }
+    if (!ok) {
+      error = "truncated";
+    }
+    return ok;
+  }
+
+private:
+  template<typename T>
+  static bool put(FILE *f, const T &v) {
+    return fwrite(&v, sizeof(v), 1, f) == 1;
+  }
+
+  template<typename T>
+  static bool get(FILE *f, T &v) {
+    return fread(&v, sizeof(v), 1, f) == 1;
+  }
+};
+
+// One row of a position file
+struct Positions_Row {
+  std::vector<float> x, y;
+  std::vector<int32_t> captured;
+  std::vector<int64_t> capture_step;
+
+  Positions_Row(const Positions_Header &h)
+    : x(h.width), y(h.width), captured(h.captures() ? h.width : 0),
+      capture_step(h.captures() ? h.width : 0) {}
+
+  bool write(FILE *f) const {
+    return fwrite(x.data(), sizeof(float), x.size(), f) == x.size() &&
+      fwrite(y.data(), sizeof(float), y.size(), f) == y.size() &&
+      fwrite(captured.data(), sizeof(int32_t), captured.size(), f) == captured.size() &&
+      fwrite(capture_step.data(), sizeof(int64_t), capture_step.size(), f) == capture_step.size();
+  }
+
+  bool read(FILE *f) {
+    return fread(x.data(), sizeof(float), x.size(), f) == x.size() &&
+      fread(y.data(), sizeof(float), y.size(), f) == y.size() &&
+      fread(captured.data(), sizeof(int32_t), captured.size(), f) == captured.size() &&
+      fread(capture_step.data(), sizeof(int64_t), capture_step.size(), f) == capture_step.size();
+  }
+};
+
+#endif
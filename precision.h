@@ -0,0 +1,320 @@
+#ifndef GRAVITY_SNAPSHOT_PRECISION_H
+#define GRAVITY_SNAPSHOT_PRECISION_H
+
+#include "integrate.h"
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+// Number type of the particles' state (-precision). The float kernels in
+// integrate.h are the fast default. Over many thousands of steps their
+// rounding adds up to visible noise along the boundaries of the basins, so
+// the kernels here keep the state in a wider type instead: double, or 32.32
+// fixed point. Fixed point rounds the same way on any CPU and compiler
+// since it is all integer arithmetic, down to the divisions.
+enum Precision {
+  PRECISION_FLOAT,
+  PRECISION_DOUBLE,
+  PRECISION_FIXED
+};
+
+inline const char *precision_name(Precision p) {
+  switch (p) {
+  case PRECISION_DOUBLE: return "double";
+  case PRECISION_FIXED: return "fixed";
+  default: return "float";
+  }
+}
+
+__extension__ typedef __int128 gs_int128;
+
+// Signed fixed point number with 32 integer and 32 fraction bits. Products
+// and quotients are rounded down. Results beyond the range saturate at its
+// ends, so a squared distance past 2^31 pixels stays huge and positive
+// instead of wrapping around to zero; division by zero saturates as well.
+struct Fixed {
+  static const int FRACTION_BITS = 32;
+  int64_t v;
+
+  Fixed() : v(0) {}
+
+  explicit Fixed(double d) : v((int64_t)floor(ldexp(d, FRACTION_BITS))) {}
+
+  static Fixed raw(int64_t r) {
+    Fixed f;
+    f.v = r;
+    return f;
+  }
+
+  explicit operator float() const {
+    return (float)ldexp((double)v, -FRACTION_BITS);
+  }
+
+  Fixed operator+(Fixed o) const {
+    int64_t r;
+    bool over = __builtin_add_overflow(v, o.v, &r);
+    return raw(over ? limit(v) : r);
+  }
+
+  Fixed operator-(Fixed o) const {
+    int64_t r;
+    bool over = __builtin_sub_overflow(v, o.v, &r);
+    return raw(over ? limit(v) : r);
+  }
+
+  Fixed operator-() const {
+    return Fixed() - *this;
+  }
+
+  Fixed operator*(Fixed o) const {
+    return saturate(((gs_int128)v * o.v) >> FRACTION_BITS);
+  }
+
+  Fixed operator/(Fixed o) const {
+    if (o.v == 0) {
+      return raw(limit(v));
+    }
+    gs_int128 n = (gs_int128)v * ((gs_int128)1 << FRACTION_BITS);
+    gs_int128 q = n / o.v;
+    // Division truncates towards zero
+    if ((n % o.v != 0) && ((n < 0) != (o.v < 0))) {
+      --q;
+    }
+    return saturate(q);
+  }
+
+  Fixed &operator+=(Fixed o) {
+    return *this = *this + o;
+  }
+
+  bool operator<(Fixed o) const {
+    return v < o.v;
+  }
+
+  bool operator>(Fixed o) const {
+    return v > o.v;
+  }
+
+private:
+  // The end of the range on the side of the sign of r
+  static int64_t limit(int64_t r) {
+    return (r >> 63) ^ INT64_MAX;
+  }
+
+  static Fixed saturate(gs_int128 r) {
+    const int64_t low = (int64_t)r;
+    return raw(low == r ? low : limit((int64_t)(r >> 64)));
+  }
+};
+
+// Largest state of one particle in any -precision type
+const size_t MAX_WIDE_SIZE = 6 * sizeof(double);
+
+template<typename T>
+struct Wide_Particle {
+  T x, y, xv, yv, xa, ya;
+};
+
+inline size_t wide_size(Precision p) {
+  switch (p) {
+  case PRECISION_DOUBLE: return sizeof(Wide_Particle<double>);
+  case PRECISION_FIXED: return sizeof(Wide_Particle<Fixed>);
+  default: return 0;
+  }
+}
+
+// INTERLEAVE particles in type T for the integrator policy, like
+// Interleaved_State but for a group of n <= INTERLEAVE. The pull is the sum
+// over every mass (or the far field), computed in T as well.
+template<typename T, int N>
+struct Wide_Group {
+  static const int G = INTERLEAVE;
+  T x[G], y[G], xv[G], yv[G], xa[G], ya[G];
+  float near[G];
+  int n;
+  const T *mx;
+  const T *my;
+  const Sim_Params &sp;
+  T dt, gravity, softening;
+
+  Wide_Group(int count, const T *pmx, const T *pmy, const Sim_Params &params)
+    : n(count), mx(pmx), my(pmy), sp(params), dt(params.dt), gravity(params.gravity),
+      softening(params.softening) {}
+
+  int size() const {
+    return n;
+  }
+
+  __attribute__((always_inline)) void drift(float c) {
+    const T h = T(c) * dt;
+    for (int k = 0; k < n; ++k) {
+      x[k] += xv[k] * h;
+      y[k] += yv[k] * h;
+    }
+  }
+
+  __attribute__((always_inline)) void kick(float c) {
+    const T h = T(c) * dt;
+    for (int k = 0; k < n; ++k) {
+      xv[k] += xa[k] * h;
+      yv[k] += ya[k] * h;
+    }
+  }
+
+  __attribute__((always_inline)) void pull() {
+    const int nm = N > 0 ? N : sp.nmasses;
+    bool far[G];
+    int nfar = 0;
+    for (int k = 0; k < n; ++k) {
+      far[k] = false;
+      if (sp.far_field) {
+	T cx = T(sp.far_x) - x[k];
+	T cy = T(sp.far_y) - y[k];
+	T c = (cx * cx) + (cy * cy);
+	far[k] = c > T(sp.far_r2);
+	if (far[k]) {
+	  T f = T(sp.far_gravity) / (c + softening);
+	  xa[k] = cx * f;
+	  ya[k] = cy * f;
+	  near[k] = INFINITY;
+	  ++nfar;
+	}
+      }
+    }
+    if (nfar == n) {
+      return;
+    }
+    T xacc[G], yacc[G], nearest[G];
+    for (int k = 0; k < n; ++k) {
+      xacc[k] = T(0);
+      yacc[k] = T(0);
+      nearest[k] = T(0);
+    }
+#pragma GCC unroll 16
+    for (int m = 0; m < nm; ++m) {
+      const T mxm = mx[m], mym = my[m];
+      for (int k = 0; k < n; ++k) {
+	T dx = mxm - x[k];
+	T dy = mym - y[k];
+	T d = (dx * dx) + (dy * dy);
+	T f = gravity / (d + softening);
+	xacc[k] += dx * f;
+	yacc[k] += dy * f;
+	nearest[k] = m == 0 || d < nearest[k] ? d : nearest[k];
+      }
+    }
+    for (int k = 0; k < n; ++k) {
+      if (!far[k]) {
+	xa[k] = xacc[k];
+	ya[k] = yacc[k];
+	near[k] = (float)nearest[k];
+      }
+    }
+  }
+};
+
+// Kernel keeping the state in T. Spans of Particles tracking the wide state
+// are loaded from and stored to it, others (as in -bench) from their floats.
+// The floats are updated either way.
+template<typename T, int N, typename P>
+void integrate_span_wide(const Span &s, int steps, const Sim_Params &sp) {
+  const int G = INTERLEAVE;
+  T local_mx[N > 0 ? N : 1], local_my[N > 0 ? N : 1];
+  static thread_local std::vector<T> all_mx, all_my;
+  const T *mx = local_mx, *my = local_my;
+  if (N > 0) {
+    for (int m = 0; m < N; ++m) {
+      local_mx[m] = T(sp.mx[m]);
+      local_my[m] = T(sp.my[m]);
+    }
+  } else {
+    all_mx.resize(sp.nmasses);
+    all_my.resize(sp.nmasses);
+    for (int m = 0; m < sp.nmasses; ++m) {
+      all_mx[m] = T(sp.mx[m]);
+      all_my[m] = T(sp.my[m]);
+    }
+    mx = all_mx.data();
+    my = all_my.data();
+  }
+
+  Wide_Particle<T> *w = (Wide_Particle<T> *)s.wide;
+  for (int i = 0; i < s.n; i += G) {
+    Wide_Group<T, N> g(std::min(G, s.n - i), mx, my, sp);
+    for (int k = 0; k < g.n; ++k) {
+      if (w) {
+	const Wide_Particle<T> &q = w[i + k];
+	g.x[k] = q.x;
+	g.y[k] = q.y;
+	g.xv[k] = q.xv;
+	g.yv[k] = q.yv;
+	g.xa[k] = q.xa;
+	g.ya[k] = q.ya;
+      } else {
+	g.x[k] = T(s.x[i + k]);
+	g.y[k] = T(s.y[i + k]);
+	g.xv[k] = T(s.xv[i + k]);
+	g.yv[k] = T(s.yv[i + k]);
+	g.xa[k] = T(s.xa[i + k]);
+	g.ya[k] = T(s.ya[i + k]);
+      }
+    }
+    find_near(g);
+    for (int j = 0; j < steps; ++j) {
+      step_encounters<P>(g);
+    }
+    for (int k = 0; k < g.n; ++k) {
+      if (w) {
+	w[i + k] = Wide_Particle<T>{g.x[k], g.y[k], g.xv[k], g.yv[k], g.xa[k], g.ya[k]};
+      }
+      s.x[i + k] = (float)g.x[k];
+      s.y[i + k] = (float)g.y[k];
+      s.xv[i + k] = (float)g.xv[k];
+      s.yv[i + k] = (float)g.yv[k];
+      s.xa[i + k] = (float)g.xa[k];
+      s.ya[i + k] = (float)g.ya[k];
+    }
+  }
+}
+
+template<int N, typename P>
+void integrate_span_double(const Span &s, int steps, const Sim_Params &sp) {
+  integrate_span_wide<double, N, P>(s, steps, sp);
+}
+
+template<int N, typename P>
+void integrate_span_fixed(const Span &s, int steps, const Sim_Params &sp) {
+  integrate_span_wide<Fixed, N, P>(s, steps, sp);
+}
+
+template<typename P>
+inline Span_Kernel wide_span_kernel(Precision p, int nmasses) {
+  if (p == PRECISION_FIXED) {
+    GS_MASS_POLICY_DISPATCH(integrate_span_fixed, nmasses, P)
+  }
+  GS_MASS_POLICY_DISPATCH(integrate_span_double, nmasses, P)
+}
+
+inline Span_Kernel wide_span_kernel(Precision p, int nmasses, Integrator i = INTEGRATOR_EULER) {
+  GS_POLICY_DISPATCH(wide_span_kernel, i, (p, nmasses))
+}
+
+// Fills in the wide state of every particle from its floats
+template<typename T>
+inline void load_wide(Particles &p) {
+  Wide_Particle<T> *w = (Wide_Particle<T> *)p.wide;
+  for (size_t i = 0; i < p.stride * p.height; ++i) {
+    w[i] = Wide_Particle<T>{T(p.x[i]), T(p.y[i]), T(p.xv[i]), T(p.yv[i]), T(p.xa[i]),
+			    T(p.ya[i])};
+  }
+}
+
+inline void load_wide(Particles &p, Precision pr) {
+  if (pr == PRECISION_DOUBLE) {
+    load_wide<double>(p);
+  } else if (pr == PRECISION_FIXED) {
+    load_wide<Fixed>(p);
+  }
+}
+
+#endif
@@ -0,0 +1,174 @@
+#ifndef GRAVITY_SNAPSHOT_QUADTREE_H
+#define GRAVITY_SNAPSHOT_QUADTREE_H
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+// Cells with at most this many masses are not split any further
+const int QUADTREE_LEAF = 8;
+// Duplicate positions would otherwise split forever
+const int QUADTREE_MAX_DEPTH = 24;
+
+// Pulls acting on a group of particles: point masses and whole cells, each
+// with its own strength (gravity times the number of masses).
+struct Interaction_List {
+  std::vector<float> x;
+  std::vector<float> y;
+  std::vector<float> g;
+  // The box the list was built for, if it was
+  bool built = false;
+  float x0 = 0, y0 = 0, x1 = 0, y1 = 0;
+
+  int size() const {
+    return (int)x.size();
+  }
+
+  void clear() {
+    x.clear();
+    y.clear();
+    g.clear();
+    built = false;
+  }
+
+  bool built_for(float bx0, float by0, float bx1, float by1) const {
+    return built && bx0 == x0 && by0 == y0 && bx1 == x1 && by1 == y1;
+  }
+
+  void add(float ix, float iy, float ig) {
+    x.push_back(ix);
+    y.push_back(iy);
+    g.push_back(ig);
+  }
+};
+
+// Barnes-Hut quadtree over the masses. They never move, so it is built once.
+// A cell of side s whose center of mass is at least s / theta away from every
+// particle of a group acts on the whole group as one mass at that center.
+// Closer cells are opened, down to the individual masses of the leaves.
+// theta trades accuracy for speed: 0 opens everything and is an exact sum.
+class Quadtree {
+public:
+  Quadtree(const float *mx, const float *my, int n, float gravity, float opening_angle)
+    : theta(opening_angle) {
+    for (int i = 0; i < n; ++i) {
+      masses.push_back(Point{mx[i], my[i]});
+    }
+    float x0 = INFINITY, y0 = INFINITY, x1 = -INFINITY, y1 = -INFINITY;
+    for (const Point &p : masses) {
+      x0 = std::min(x0, p.x);
+      y0 = std::min(y0, p.y);
+      x1 = std::max(x1, p.x);
+      y1 = std::max(y1, p.y);
+    }
+    if (n > 0) {
+      nodes.resize(1);
+      build(0, 0, n, x0, y0, std::max(x1 - x0, y1 - y0), gravity, 0);
+    }
+    unit_gravity = gravity;
+  }
+
+  int size() const {
+    return (int)nodes.size();
+  }
+
+  // Fills `list` with everything pulling on particles inside the box
+  // [x0, x1] x [y0, y1]
+  void interactions(float x0, float y0, float x1, float y1, Interaction_List &list) const {
+    list.clear();
+    list.built = true;
+    list.x0 = x0;
+    list.y0 = y0;
+    list.x1 = x1;
+    list.y1 = y1;
+    if (nodes.empty()) {
+      return;
+    }
+    int stack[4 * QUADTREE_MAX_DEPTH + 4];
+    int top = 0;
+    stack[top++] = 0;
+    while (top > 0) {
+      const Node &c = nodes[stack[--top]];
+      float dx = std::max(0.0f, std::max(x0 - c.cx, c.cx - x1));
+      float dy = std::max(0.0f, std::max(y0 - c.cy, c.cy - y1));
+      float d2 = dx * dx + dy * dy;
+      if (c.side * c.side < theta * theta * d2) {
+	list.add(c.cx, c.cy, c.g);
+      } else if (c.child < 0) {
+	for (int i = c.first; i < c.first + c.count; ++i) {
+	  list.add(masses[i].x, masses[i].y, unit_gravity);
+	}
+      } else {
+	for (int k = 0; k < 4; ++k) {
+	  if (nodes[c.child + k].count > 0) {
+	    stack[top++] = c.child + k;
+	  }
+	}
+      }
+    }
+  }
+
+private:
+  struct Point {
+    float x;
+    float y;
+  };
+
+  struct Node {
+    float cx;   // center of mass
+    float cy;
+    float side;
+    float g;    // gravity * count
+    int first;  // masses [first, first + count) lie in this cell
+    int count;
+    int child;  // index of the first of 4 children, -1 for a leaf
+  };
+
+  // Fills in cell `index` for masses [first, last), which lie within the
+  // square of side `side` at (x0, y0), and builds its children
+  void build(int index, int first, int last, float x0, float y0, float side, float gravity,
+	     int depth) {
+    double sx = 0, sy = 0;
+    for (int i = first; i < last; ++i) {
+      sx += masses[i].x;
+      sy += masses[i].y;
+    }
+    int count = last - first;
+    Node &c = nodes[index];
+    c.cx = count > 0 ? sx / count : x0;
+    c.cy = count > 0 ? sy / count : y0;
+    c.side = side;
+    c.g = gravity * count;
+    c.first = first;
+    c.count = count;
+    c.child = -1;
+    if (count <= QUADTREE_LEAF || depth >= QUADTREE_MAX_DEPTH) {
+      return;
+    }
+
+    float h = side / 2;
+    float mid_x = x0 + h, mid_y = y0 + h;
+    Point *begin = masses.data() + first, *end = masses.data() + last;
+    Point *split_y = std::partition(begin, end, [=](const Point &p) { return p.y < mid_y; });
+    Point *split_top = std::partition(begin, split_y, [=](const Point &p) { return p.x < mid_x; });
+    Point *split_bottom = std::partition(split_y, end, [=](const Point &p) { return p.x < mid_x; });
+    int bounds[5] = {first, (int)(split_top - masses.data()), (int)(split_y - masses.data()),
+		     (int)(split_bottom - masses.data()), last};
+
+    // The 4 children are stored next to each other
+    int child = nodes.size();
+    c.child = child;
+    nodes.resize(nodes.size() + 4); // invalidates c
+    for (int k = 0; k < 4; ++k) {
+      build(child + k, bounds[k], bounds[k + 1], x0 + (k % 2) * h, y0 + (k / 2) * h, h,
+	    gravity, depth + 1);
+    }
+  }
+
+  float theta;
+  float unit_gravity = 0;
+  std::vector<Point> masses;
+  std::vector<Node> nodes;
+};
+
+#endif
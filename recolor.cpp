@@ -0,0 +1,257 @@
+#include "png-writer.h"
+#include "positions.h"
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+// Colors the position files saved by gs -positions into PNG images. Only
+// the coloring is done again, so trying out another rule or palette on a
+// long run takes as long as reading the file instead of the whole render.
+
+enum Rule {
+  RULE_WEIGHTED,
+  RULE_CLOSEST,
+  RULE_CAPTURE
+};
+
+// Most colors a palette can have
+const int MAX_COLORS = 64;
+
+Rule rule = RULE_WEIGHTED;
+// Mass i gets color i % the number of colors
+std::vector<std::vector<unsigned char> > palette;
+int compression = 6;
+
+// gs's coloring: full strength for the nearest mass's color, and for every
+// other one a weight that falls off with how close it is compared to the
+// rest. With the default palette the same image gs rendered.
+void color_weighted(float px, float py, const Positions_Header &h, unsigned char *out) {
+  const int nc = palette.size();
+  const int n = h.mx.size();
+  int c = 0;
+  float dist_of[MAX_COLORS];
+  float total = 0;
+  float dist = INFINITY;
+  for (int i = 0; i < n; ++i) {
+    float d = hypotf(px - h.mx[i], py - h.my[i]);
+    if (d < dist) {
+      c = i % nc;
+      dist = d;
+    } else {
+      total += d;
+    }
+    dist_of[i % nc] = d;
+  }
+  int mix[3] = {0, 0, 0};
+  for (int k = 0; k < std::min(nc, n); ++k) {
+    // The same conversion as gs, which wraps around for far masses
+    int w = k == c ? 255 : (unsigned char)(int32_t)(255 * (total - dist_of[k]) / total);
+    for (int j = 0; j < 3; ++j) {
+      mix[j] += (palette[k][j] * w + 127) / 255;
+    }
+  }
+  for (int j = 0; j < 3; ++j) {
+    out[j] = std::min(mix[j], 255);
+  }
+}
+
+void color_closest(float px, float py, const Positions_Header &h, unsigned char *out) {
+  int c = 0;
+  float dist = INFINITY;
+  for (int i = 0; i < (int)h.mx.size(); ++i) {
+    float d = hypotf(px - h.mx[i], py - h.my[i]);
+    if (d < dist) {
+      c = i;
+      dist = d;
+    }
+  }
+  memcpy(out, palette[c % palette.size()].data(), 3);
+}
+
+// The capturing mass's color, darker the later the capture. Black if the
+// point was not captured.
+void color_capture(int mass, int64_t step, const Positions_Header &h, unsigned char *out) {
+  if (mass < 0) {
+    memset(out, 0, 3);
+    return;
+  }
+  float shade = h.steps > 0 ? 1 - 0.75f * step / h.steps : 1;
+  for (int j = 0; j < 3; ++j) {
+    out[j] = (unsigned char)(palette[mass % palette.size()][j] * shade);
+  }
+}
+
+// Colors the rows of f after its header into the PNG file out
+bool write_png(FILE *f, const Positions_Header &h, const std::string &in, const std::string &out) {
+  Png_Writer png(out.c_str(), h.width, h.height, compression);
+  if (!png.ok()) {
+    printf("Error: could not open `%s` for writing\n", out.c_str());
+    return false;
+  }
+  Positions_Row row(h);
+  std::vector<unsigned char> rgb(3 * h.width);
+  for (int y = 0; y < h.height; ++y) {
+    if (!row.read(f)) {
+      printf("Error: `%s` is truncated\n", in.c_str());
+      return false;
+    }
+    for (int x = 0; x < h.width; ++x) {
+      if (rule == RULE_WEIGHTED) {
+	color_weighted(row.x[x], row.y[x], h, &rgb[3 * x]);
+      } else if (rule == RULE_CLOSEST) {
+	color_closest(row.x[x], row.y[x], h, &rgb[3 * x]);
+      } else {
+	color_capture(row.captured[x], row.capture_step[x], h, &rgb[3 * x]);
+      }
+    }
+    png.write_row(rgb.data());
+  }
+  if (!png.finish()) {
+    printf("Error: failed writing `%s`\n", out.c_str());
+    return false;
+  }
+  return true;
+}
+
+// The image is written to a temporary file that is renamed once complete,
+// so a bad position file never leaves a broken image behind
+bool recolor(const std::string &in, const std::string &out) {
+  FILE *f = fopen(in.c_str(), "rb");
+  if (!f) {
+    printf("Error: could not open `%s`\n", in.c_str());
+    return false;
+  }
+  Positions_Header h;
+  std::string error;
+  if (!h.read(f, error)) {
+    printf("Error: `%s` is %s\n", in.c_str(), error.c_str());
+    fclose(f);
+    return false;
+  }
+  if (rule == RULE_CAPTURE && !h.captures()) {
+    printf("Error: `%s` has no captures, render with -capture\n", in.c_str());
+    fclose(f);
+    return false;
+  }
+  const std::string temp = out + ".tmp";
+  bool ok = write_png(f, h, in, temp);
+  fclose(f);
+  if (ok && rename(temp.c_str(), out.c_str()) != 0) {
+    printf("Error: could not rename `%s` to `%s`\n", temp.c_str(), out.c_str());
+    ok = false;
+  }
+  if (!ok) {
+    remove(temp.c_str());
+  }
+  return ok;
+}
+
+// Colors as RRGGBB hex values separated by commas
+bool parse_palette(const char *s) {
+  palette.clear();
+  while (*s) {
+    char *end;
+    unsigned long c = strtoul(s, &end, 16);
+    if (end - s != 6 || (*end && *end != ',') || (int)palette.size() == MAX_COLORS) {
+      return false;
+    }
+    palette.push_back({(unsigned char)(c >> 16), (unsigned char)(c >> 8), (unsigned char)c});
+    s = *end ? end + 1 : end;
+  }
+  return !palette.empty();
+}
+
+void print_help() {
+  printf("Usage: recolor [options] file.gsp...\n"
+	 "Colors the position files saved by gs -positions into PNG images, each\n"
+	 "next to its file and named after it with _recolor.png in place of the\n"
+	 "extension, which leaves the frames gs rendered alone\n\n"
+	 "   -rule [type]         weighted (default) colors like gs. closest gives\n"
+	 "                        each point the color of its nearest mass, capture\n"
+	 "                        that of the mass it was captured by, darker the\n"
+	 "                        later it was, or black (needs -capture in gs)\n"
+	 "   -colors [list]       the masses' colors as RRGGBB hex values separated by\n"
+	 "                        commas, which repeat for more masses. Default is\n"
+	 "                        ff0000,00ff00,0000ff for weighted and gs's red, green\n"
+	 "                        and blue otherwise\n"
+	 "   -o [file]            name of the image, for a single position file\n"
+	 "   -compression [0-9]   PNG compression level, default is 6\n"
+	 "\n   -help, --help        show this help info\n"
+    );
+  exit(1);
+}
+
+#define FLAG_IS(flag) (strcmp(flag, argv[i]) == 0)
+#define TAKES_PARAM(flag) if(i+1 >= argc){printf("Error: " flag " flag requires an argument\n");} else {++i;}
+
+int main(int argc, char *argv[]) {
+  std::vector<std::string> inputs;
+  std::string output;
+  for (int i = 1; i < argc; i += 1) {
+    if (FLAG_IS("-rule")) {
+      TAKES_PARAM("-rule")
+      if (strcmp(argv[i], "weighted") == 0) {
+	rule = RULE_WEIGHTED;
+      } else if (strcmp(argv[i], "closest") == 0) {
+	rule = RULE_CLOSEST;
+      } else if (strcmp(argv[i], "capture") == 0) {
+	rule = RULE_CAPTURE;
+      } else {
+	printf("Error: unknown rule `%s`\n\n", argv[i]);
+	print_help();
+      }
+    } else if (FLAG_IS("-colors")) {
+      TAKES_PARAM("-colors")
+      if (!parse_palette(argv[i])) {
+	printf("Error: could not read the colors `%s`\n\n", argv[i]);
+	print_help();
+      }
+    } else if (FLAG_IS("-o")) {
+      TAKES_PARAM("-o")
+      output = argv[i];
+    } else if (FLAG_IS("-compression")) {
+      TAKES_PARAM("-compression")
+      compression = std::min(9, std::max(0, std::stoi(argv[i])));
+    }
+
+    else if (FLAG_IS("-help") || FLAG_IS("--help")) {
+      print_help();
+    }
+    else if (argv[i][0] == '-') {
+      printf("Unrecognized argument %s\n\n", argv[i]);
+      print_help();
+    } else {
+      inputs.push_back(argv[i]);
+    }
+  }
+  if (inputs.empty()) {
+    print_help();
+  }
+  if (!output.empty() && inputs.size() > 1) {
+    printf("Error: -o names the image of a single position file\n");
+    exit(1);
+  }
+  if (palette.empty() && rule == RULE_WEIGHTED) {
+    palette = {{255, 0, 0}, {0, 255, 0}, {0, 0, 255}};
+  } else if (palette.empty()) {
+    palette = {{167, 38, 8}, {122, 179, 131}, {118, 120, 219}};
+  }
+
+  for (const std::string &in : inputs) {
+    std::string out = output;
+    if (out.empty()) {
+      size_t dot = in.rfind('.');
+      size_t slash = in.rfind('/');
+      out = in.substr(0, dot != std::string::npos && (slash == std::string::npos || dot > slash) ?
+		      dot : in.size()) + "_recolor.png";
+    }
+    if (!recolor(in, out)) {
+      exit(1);
+    }
+  }
+  return 0;
+}
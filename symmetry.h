@@ -0,0 +1,127 @@
+#ifndef GRAVITY_SNAPSHOT_SYMMETRY_H
+#define GRAVITY_SNAPSHOT_SYMMETRY_H
+
+#include <cmath>
+#include <vector>
+
+// Symmetries of the mass layout that also map the pixel grid onto itself:
+// mirroring about a vertical axis, about a horizontal axis, and both at once
+// (a half turn). The particle of a pixel mirrored onto another pixel follows
+// the mirror image of that pixel's path, so only one pixel of each orbit,
+// its source, has to be integrated.
+//
+// Every symmetry of a finite set of points keeps their center in place, so
+// that is where the axes go. A mirror is only used when the axis lies on a
+// pixel or halfway between two, otherwise no pixel maps onto another one.
+struct Symmetry {
+  struct Element {
+    bool flip_x;
+    bool flip_y;
+    std::vector<int> perm; // mass m maps onto mass perm[m]
+  };
+
+  int width = 0;
+  int height = 0;
+  int axis_x2 = 0; // twice the axes' coordinates
+  int axis_y2 = 0;
+  std::vector<Element> elements; // without the identity
+
+  Symmetry() {}
+
+  Symmetry(const float *mx, const float *my, int n, int w, int h) : width(w), height(h) {
+    if (n == 0) {
+      return;
+    }
+    double cx = 0, cy = 0;
+    for (int m = 0; m < n; ++m) {
+      cx += mx[m];
+      cy += my[m];
+    }
+    cx /= n;
+    cy /= n;
+    bool x_aligned = fabs(2 * cx - round(2 * cx)) < 1e-3;
+    bool y_aligned = fabs(2 * cy - round(2 * cy)) < 1e-3;
+    axis_x2 = (int)round(2 * cx);
+    axis_y2 = (int)round(2 * cy);
+
+    const bool flips[3][2] = {{true, false}, {false, true}, {true, true}};
+    for (const bool *f : flips) {
+      if ((f[0] && !x_aligned) || (f[1] && !y_aligned)) {
+	continue;
+      }
+      Element e = {f[0], f[1], std::vector<int>(n, -1)};
+      bool symmetric = true;
+      for (int m = 0; m < n && symmetric; ++m) {
+	double x = f[0] ? 2 * cx - mx[m] : mx[m];
+	double y = f[1] ? 2 * cy - my[m] : my[m];
+	for (int k = 0; k < n; ++k) {
+	  if (fabs(x - mx[k]) < 1e-3 && fabs(y - my[k]) < 1e-3) {
+	    e.perm[m] = k;
+	    break;
+	  }
+	}
+	symmetric = e.perm[m] >= 0;
+      }
+      if (symmetric) {
+	elements.push_back(e);
+      }
+    }
+  }
+
+  bool empty() const {
+    return elements.empty();
+  }
+
+  // Image of pixel (px, py) under element e, false if it is off the frame
+  bool map_pixel(const Element &e, int px, int py, int &qx, int &qy) const {
+    qx = e.flip_x ? axis_x2 - px : px;
+    qy = e.flip_y ? axis_y2 - py : py;
+    return qx >= 0 && qy >= 0 && qx < width && qy < height;
+  }
+
+  // Image of a particle's position, velocity or acceleration under e
+  template<typename T>
+  void map_position(const Element &e, T &x, T &y) const {
+    if (e.flip_x) {
+      x = T(axis_x2) - x;
+    }
+    if (e.flip_y) {
+      y = T(axis_y2) - y;
+    }
+  }
+
+  template<typename T>
+  void map_vector(const Element &e, T &x, T &y) const {
+    if (e.flip_x) {
+      x = -x;
+    }
+    if (e.flip_y) {
+      y = -y;
+    }
+  }
+
+  // Whether (px, py) is the source of its orbit: the first of its images on
+  // the frame in row major order
+  bool is_source(int px, int py) const {
+    for (const Element &e : elements) {
+      int qx, qy;
+      if (map_pixel(e, px, py, qx, qy) && (qy < py || (qy == py && qx < px))) {
+	return false;
+      }
+    }
+    return true;
+  }
+
+  // Share of the pixels that have to be integrated
+  float source_fraction() const {
+    long long n = 0;
+    for (int py = 0; py < height; ++py) {
+      for (int px = 0; px < width; ++px) {
+	n += is_source(px, py);
+      }
+    }
+    return (float)n / ((long long)width * height);
+  }
+};
+
+#endif
@@ -0,0 +1,96 @@
+#ifndef GRAVITY_SNAPSHOT_SYMPLECTIC_H
+#define GRAVITY_SNAPSHOT_SYMPLECTIC_H
+
+// Fixed step integrators, as policies the kernels in integrate.h are
+// templated on. A policy's step() advances a particle state S by one time
+// step of dt through three operations S provides:
+//   drift(c)  position += c * dt * velocity
+//   kick(c)   velocity += c * dt * pull, using the pull computed last
+//   pull()    compute the pull at the current position
+// S is one particle, a group of interleaved particles or a vector of them,
+// and all of it is inlined into the kernel's step loop.
+//
+// PULLS is the number of times a step computes the pull, which is what a
+// step costs.
+
+// The original scheme: the position moves with the old velocity, the
+// velocity with the pull from the step before. First order, and it drifts
+// in energy, so it needs small steps for long renders.
+struct Euler_Step {
+  static const int PULLS = 1;
+
+  template<typename S>
+  __attribute__((always_inline)) static void step(S &s) {
+    s.drift(1);
+    s.kick(1);
+    s.pull();
+  }
+};
+
+// Velocity Verlet: second order and symplectic, so the energy error stays
+// bounded instead of growing. Expects the stored pull to belong to the
+// current position, which it leaves true after every step.
+struct Verlet_Step {
+  static const int PULLS = 1;
+
+  template<typename S>
+  __attribute__((always_inline)) static void step(S &s) {
+    s.kick(.5f);
+    s.drift(1);
+    s.pull();
+    s.kick(.5f);
+  }
+};
+
+// Yoshida's fourth order triple jump, also known as Forest-Ruth: three
+// Verlet steps of w1, w0 and w1 times dt, with adjacent kicks merged
+struct Yoshida_Step {
+  static const int PULLS = 3;
+
+  template<typename S>
+  __attribute__((always_inline)) static void step(S &s) {
+    // w1 = 1 / (2 - 2^(1/3)), w0 = 1 - 2 * w1
+    const float w1 = 1.3512071919596578f;
+    const float w0 = -1.7024143839193153f;
+    s.kick(w1 / 2);
+    s.drift(w1);
+    s.pull();
+    s.kick((w1 + w0) / 2);
+    s.drift(w0);
+    s.pull();
+    s.kick((w0 + w1) / 2);
+    s.drift(w1);
+    s.pull();
+    s.kick(w1 / 2);
+  }
+};
+
+// Position extended Forest-Ruth like (Omelyan, Mryglod and Folk 2002):
+// fourth order with an error constant about 100 times smaller than
+// Forest-Ruth's, for one more pull per step. Starts and ends with a drift,
+// so it does not rely on the stored pull.
+struct Pefrl_Step {
+  static const int PULLS = 4;
+
+  template<typename S>
+  __attribute__((always_inline)) static void step(S &s) {
+    const float xi = .1786178958448091f;
+    const float lambda = -.2123418310626054f;
+    const float chi = -.06626458266981849f;
+    s.drift(xi);
+    s.pull();
+    s.kick((1 - 2 * lambda) / 2);
+    s.drift(chi);
+    s.pull();
+    s.kick(lambda);
+    s.drift(1 - 2 * (chi + xi));
+    s.pull();
+    s.kick(lambda);
+    s.drift(chi);
+    s.pull();
+    s.kick((1 - 2 * lambda) / 2);
+    s.drift(xi);
+  }
+};
+
+#endif
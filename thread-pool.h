@@ -0,0 +1,131 @@
+#ifndef GRAVITY_SNAPSHOT_THREAD_POOL_H
+#define GRAVITY_SNAPSHOT_THREAD_POOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A fixed set of worker threads that live for the whole run. Work is handed
+// out as a number of independent tasks (tiles of the frame); run() hands the
+// task indices out to the workers and the calling thread, and returns once
+// every one of them has finished.
+class ThreadPool {
+public:
+  explicit ThreadPool(int nthreads) {
+    if (nthreads < 1) {
+      nthreads = 1;
+    }
+    // The thread calling run() does its share of the work too
+    for (int i = 1; i < nthreads; ++i) {
+      workers.emplace_back(&ThreadPool::worker_loop, this);
+    }
+  }
+
+  ~ThreadPool() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+    }
+    wake.notify_all();
+    for (auto &t : workers) {
+      t.join();
+    }
+  }
+
+  ThreadPool(const ThreadPool &) = delete;
+  ThreadPool &operator=(const ThreadPool &) = delete;
+
+  int size() const {
+    return (int)workers.size() + 1;
+  }
+
+  void run(int ntasks, const std::function<void(int)> &fn) {
+    if (ntasks <= 0) {
+      return;
+    }
+    if (workers.empty() || ntasks == 1) {
+      for (int i = 0; i < ntasks; ++i) {
+	fn(i);
+      }
+      return;
+    }
+
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      task = &fn;
+      task_count = ntasks;
+      next_task = 0;
+      remaining = ntasks;
+      ++generation;
+    }
+    wake.notify_all();
+
+    int finished = do_tasks(fn, ntasks);
+
+    std::unique_lock<std::mutex> lock(mutex);
+    remaining -= finished;
+    // Workers still inside do_tasks() hold on to fn, so wait for them to
+    // leave before the caller is allowed to destroy it
+    done.wait(lock, [this] { return remaining == 0 && active == 0; });
+    task = nullptr;
+  }
+
+private:
+  int do_tasks(const std::function<void(int)> &fn, int ntasks) {
+    int finished = 0;
+    for (int i = next_task++; i < ntasks; i = next_task++) {
+      fn(i);
+      ++finished;
+    }
+    return finished;
+  }
+
+  void worker_loop() {
+    unsigned long seen = 0;
+    while (true) {
+      const std::function<void(int)> *fn;
+      int ntasks;
+      {
+	std::unique_lock<std::mutex> lock(mutex);
+	wake.wait(lock, [&] { return stopping || generation != seen; });
+	if (stopping) {
+	  return;
+	}
+	seen = generation;
+	if (task == nullptr) {
+	  // Woke up after that batch was already finished
+	  continue;
+	}
+	fn = task;
+	ntasks = task_count;
+	++active;
+      }
+      int finished = do_tasks(*fn, ntasks);
+      {
+	std::lock_guard<std::mutex> lock(mutex);
+	remaining -= finished;
+	--active;
+	if (remaining == 0 && active == 0) {
+	  done.notify_all();
+	}
+      }
+    }
+  }
+
+  std::vector<std::thread> workers;
+  std::mutex mutex;
+  std::condition_variable wake;
+  std::condition_variable done;
+  const std::function<void(int)> *task = nullptr;
+  int task_count = 0;
+  std::atomic<int> next_task{0};
+  int remaining = 0;
+  int active = 0;
+  unsigned long generation = 0;
+  bool stopping = false;
+};
+
+#endif
@@ -0,0 +1,103 @@
+#ifndef GRAVITY_SNAPSHOT_VIDEO_STREAM_H
+#define GRAVITY_SNAPSHOT_VIDEO_STREAM_H
+
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <unistd.h>
+#include <vector>
+
+enum Stream_Format {
+  STREAM_Y4M,
+  STREAM_RGB
+};
+
+// Writes frames back to back into one file, pipe or FIFO, ready to be piped
+// into an encoder:
+//   y4m: YUV4MPEG2, 4:4:4 planar with BT.601 limited range colors. Carries
+//        its own size and frame rate, e.g. `| ffmpeg -i - out.mp4`
+//   rgb: bare interleaved RGB24 frames, e.g.
+//        `| ffmpeg -f rawvideo -pix_fmt rgb24 -s WxH -r 30 -i - out.mp4`
+//
+// A path of "-" streams to stdout. Everything the program prints to stdout
+// afterwards is sent to stderr instead, so it cannot end up in the video.
+class Video_Stream {
+public:
+  Video_Stream(const char *path, Stream_Format fmt, int w, int h, int fps)
+    : format(fmt), width(w), height(h) {
+    // A closed pipe should be reported as a failed write, not kill us
+    signal(SIGPIPE, SIG_IGN);
+    if (strcmp(path, "-") == 0) {
+      fflush(stdout);
+      int fd = dup(STDOUT_FILENO);
+      if (fd < 0 || dup2(STDERR_FILENO, STDOUT_FILENO) < 0) {
+	return;
+      }
+      file = fdopen(fd, "wb");
+    } else {
+      file = fopen(path, "wb");
+    }
+    if (!file) {
+      return;
+    }
+    setvbuf(file, nullptr, _IOFBF, 1 << 20);
+    if (format == STREAM_Y4M) {
+      fprintf(file, "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C444 XCOLORRANGE=LIMITED\n",
+	      width, height, fps);
+    }
+    failed = ferror(file) != 0;
+  }
+
+  ~Video_Stream() {
+    if (file) {
+      fclose(file);
+    }
+  }
+
+  Video_Stream(const Video_Stream &) = delete;
+  Video_Stream &operator=(const Video_Stream &) = delete;
+
+  bool ok() const {
+    return file != nullptr && !failed;
+  }
+
+  // Appends one frame given as three planes of width * height bytes
+  bool write_frame(const unsigned char *r, const unsigned char *g, const unsigned char *b) {
+    if (!ok()) {
+      return false;
+    }
+    const size_t n = (size_t)width * height;
+    if (format == STREAM_Y4M) {
+      buffer.resize(3 * n);
+      unsigned char *py = buffer.data(), *pu = py + n, *pv = pu + n;
+      for (size_t i = 0; i < n; ++i) {
+	int R = r[i], G = g[i], B = b[i];
+	py[i] = ((66 * R + 129 * G + 25 * B + 128) >> 8) + 16;
+	pu[i] = ((-38 * R - 74 * G + 112 * B + 128) >> 8) + 128;
+	pv[i] = ((112 * R - 94 * G - 18 * B + 128) >> 8) + 128;
+      }
+      fputs("FRAME\n", file);
+    } else {
+      buffer.resize(3 * n);
+      for (size_t i = 0; i < n; ++i) {
+	buffer[3 * i] = r[i];
+	buffer[3 * i + 1] = g[i];
+	buffer[3 * i + 2] = b[i];
+      }
+    }
+    if (fwrite(buffer.data(), 1, buffer.size(), file) != buffer.size() || fflush(file) != 0) {
+      failed = true;
+    }
+    return !failed;
+  }
+
+private:
+  Stream_Format format;
+  int width;
+  int height;
+  FILE *file = nullptr;
+  bool failed = false;
+  std::vector<unsigned char> buffer;
+};
+
+#endif